@@ -0,0 +1,56 @@
+// Schema of the database: which tables exist and which keys each one holds.
+
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <string>
+#include <vector>
+
+#include "txn/common.h"
+#include "txn/txn.h"
+
+using std::vector;
+
+// Number of records in each table of the default schema.
+#define TABLE_SIZE 1000000
+
+// One registered table. Its records have the contiguous keys
+// [first_key_, first_key_ + rows_).
+struct TableSpec {
+  string name_;
+  Key first_key_;
+  uint64 rows_;
+};
+
+// Tables are registered once, before the TxnProcessor (and so the storage) is
+// built, and are identified by the TableType id AddTable() returns. Ids are
+// handed out in registration order, so CHECKING and SAVINGS name the first
+// two tables registered.
+class Catalog {
+ public:
+  // Registers a table holding 'rows' records starting at 'first_key' and
+  // returns its id.
+  TableType AddTable(const string& name, uint64 rows, Key first_key = 0) {
+    tables_.push_back(TableSpec{name, first_key, rows});
+    return static_cast<TableType>(tables_.size() - 1);
+  }
+
+  // Number of registered tables. Valid ids are 0..TableCount()-1.
+  int TableCount() const { return tables_.size(); }
+
+  const TableSpec& Spec(TableType tbl) const { return tables_[tbl]; }
+
+  // The checking/savings schema: CHECKING and SAVINGS with TABLE_SIZE
+  // records each.
+  static Catalog Default() {
+    Catalog catalog;
+    catalog.AddTable("checking", TABLE_SIZE);
+    catalog.AddTable("savings", TABLE_SIZE);
+    return catalog;
+  }
+
+ private:
+  vector<TableSpec> tables_;
+};
+
+#endif  // _CATALOG_H_
@@ -0,0 +1,87 @@
+// Policies deciding when (and whether) a txn that aborted on a conflict runs
+// again.
+
+#ifndef _CONTENTION_MANAGER_H_
+#define _CONTENTION_MANAGER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "txn/common.h"
+
+// Consulted by the TxnProcessor every time a txn aborts because of a conflict
+// with another txn (not when its own logic aborts). Called concurrently from
+// all worker threads.
+class ContentionManager {
+ public:
+  virtual ~ContentionManager() {}
+
+  // 'retries' is how many times the txn has been restarted before, so 0 on
+  // its first abort. Returns false to give up on the txn, which is then
+  // handed back to the client as ABORTED. Otherwise sets '*delay' to how
+  // many seconds to hold the txn back before running it again. Retries that
+  // are due run ahead of new requests, so a delay of 0 retries right away.
+  virtual bool Retry(int retries, double* delay) = 0;
+};
+
+// Retries every txn right away, as often as it takes.
+class ImmediateRetry : public ContentionManager {
+ public:
+  virtual bool Retry(int retries, double* delay) {
+    *delay = 0;
+    return true;
+  }
+};
+
+// Exponential backoff: the n-th retry waits up to base_delay * 2^n seconds,
+// capped at max_delay. With 'randomized' set the wait is drawn uniformly from
+// [0, that bound], so txns that collided once do not collide again on their
+// way back in.
+//
+// Txns that have been restarted 'aging_threshold' times or more are
+// considered starved and retried without delay, ahead of everything still
+// backing off. A txn restarted more than 'retry_budget' times is given up on
+// (0 means never).
+class BackoffManager : public ContentionManager {
+ public:
+  explicit BackoffManager(double base_delay = 0.00001,
+                          double max_delay = 0.001,
+                          int aging_threshold = 8,
+                          int retry_budget = 0,
+                          bool randomized = true)
+      : base_delay_(base_delay), max_delay_(max_delay),
+        aging_threshold_(aging_threshold), retry_budget_(retry_budget),
+        randomized_(randomized) {
+  }
+
+  virtual bool Retry(int retries, double* delay) {
+    if (retry_budget_ > 0 && retries >= retry_budget_) {
+      return false;
+    }
+    if (retries >= aging_threshold_) {
+      *delay = 0;
+      return true;
+    }
+
+    // Shifting by more than ~30 would overflow; the cap applies by then.
+    double bound = std::min(max_delay_,
+                            base_delay_ * (1 << std::min(retries, 30)));
+    if (randomized_) {
+      static thread_local unsigned int seed =
+          static_cast<unsigned int>(reinterpret_cast<uintptr_t>(&seed));
+      bound *= static_cast<double>(rand_r(&seed)) / RAND_MAX;
+    }
+    *delay = bound;
+    return true;
+  }
+
+ private:
+  double base_delay_;
+  double max_delay_;
+  int aging_threshold_;
+  int retry_budget_;
+  bool randomized_;
+};
+
+#endif  // _CONTENTION_MANAGER_H_
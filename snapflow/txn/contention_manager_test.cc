@@ -0,0 +1,79 @@
+// Checks the retry delays and budgets of the contention managers.
+
+#include "txn/contention_manager.h"
+
+#include "utils/testing.h"
+
+TEST(ImmediateRetryTest) {
+  ImmediateRetry manager;
+  double delay = 1;
+  EXPECT_TRUE(manager.Retry(0, &delay));
+  EXPECT_EQ(0, delay);
+  EXPECT_TRUE(manager.Retry(1000, &delay));
+  EXPECT_EQ(0, delay);
+
+  END;
+}
+
+TEST(BackoffGrowthTest) {
+  BackoffManager manager(0.001, 0.008, 100, 0, false);
+  double delay;
+  double expected[] = {0.001, 0.002, 0.004, 0.008, 0.008, 0.008};
+  for (int retries = 0; retries < 6; retries++) {
+    EXPECT_TRUE(manager.Retry(retries, &delay));
+    EXPECT_EQ(expected[retries], delay);
+  }
+
+  // No overflow for txns restarted very often.
+  EXPECT_TRUE(manager.Retry(99, &delay));
+  EXPECT_EQ(0.008, delay);
+
+  END;
+}
+
+TEST(BackoffRandomizedTest) {
+  BackoffManager manager(0.001, 0.008, 100, 0, true);
+  double delay;
+  double sum = 0;
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_TRUE(manager.Retry(2, &delay));
+    EXPECT_TRUE(delay >= 0 && delay <= 0.004);
+    sum += delay;
+  }
+  // Drawn from the whole range, not stuck at one end of it.
+  EXPECT_TRUE(sum / 1000 > 0.001 && sum / 1000 < 0.003);
+
+  END;
+}
+
+TEST(BackoffAgingTest) {
+  BackoffManager manager(0.001, 0.008, 3, 0, false);
+  double delay;
+  EXPECT_TRUE(manager.Retry(2, &delay));
+  EXPECT_EQ(0.004, delay);
+  EXPECT_TRUE(manager.Retry(3, &delay));
+  EXPECT_EQ(0, delay);
+  EXPECT_TRUE(manager.Retry(50, &delay));
+  EXPECT_EQ(0, delay);
+
+  END;
+}
+
+TEST(BackoffBudgetTest) {
+  BackoffManager manager(0.001, 0.008, 100, 3, false);
+  double delay;
+  EXPECT_TRUE(manager.Retry(0, &delay));
+  EXPECT_TRUE(manager.Retry(2, &delay));
+  EXPECT_FALSE(manager.Retry(3, &delay));
+  EXPECT_FALSE(manager.Retry(4, &delay));
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  ImmediateRetryTest();
+  BackoffGrowthTest();
+  BackoffRandomizedTest();
+  BackoffAgingTest();
+  BackoffBudgetTest();
+}
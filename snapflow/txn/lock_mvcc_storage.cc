@@ -3,44 +3,20 @@
 #include "txn/lock_mvcc_storage.h"
 
 LockMVCCStorage::~LockMVCCStorage() {
-  // clear checking table
-  for (unordered_map<Key, deque<Version*>*>::iterator it = lock_mvcc_data_[CHECKING].begin();
-       it != lock_mvcc_data_[CHECKING].end(); ++it) {
-    delete it->second;
+  for (size_t i = 0; i < lock_mvcc_data_.size(); ++i) {
+    delete lock_mvcc_data_[i];
   }
-
-  // clear savings table
-  for (unordered_map<Key, deque<Version*>*>::iterator it = lock_mvcc_data_[SAVINGS].begin();
-       it != lock_mvcc_data_[SAVINGS].end(); ++it) {
-    delete it->second;
-  }
-
-  // clear storage
   lock_mvcc_data_.clear();
-
-  for (unordered_map<Key, Mutex*>::iterator it = mutexs_[CHECKING].begin();
-       it != mutexs_[CHECKING].end(); ++it) {
-    delete it->second;
-  }
-
-  for (unordered_map<Key, Mutex*>::iterator it = mutexs_[SAVINGS].begin();
-       it != mutexs_[SAVINGS].end(); ++it) {
-    delete it->second;
-  }
-
-  mutexs_.clear();
-
 }
 
 bool LockMVCCStorage::Read(Key key, Version** result, uint64 txn_unique_id, const TableType tbl_type, const bool& val) {
-  if (lock_mvcc_data_[tbl_type].count(key)) {
-    deque<Version*>* data_versions_p = lock_mvcc_data_[tbl_type][key];
-    for (deque<Version*>::iterator it = data_versions_p->begin();
-         it != data_versions_p->end(); ++it) {
-      if ((*it)->version_id_ < txn_unique_id){
-        if (txn_unique_id > (*it)->max_read_id_)
-          (*it)->max_read_id_ = txn_unique_id;
-        *result = *it;
+  LockRecord* record = lock_mvcc_data_[tbl_type]->Find(key);
+  if (record != NULL) {
+    for (Version* v = record->versions_.Head(); v != NULL; v = v->Next()) {
+      if (v->version_id_ < txn_unique_id){
+        if (txn_unique_id > v->max_read_id_)
+          v->max_read_id_ = txn_unique_id;
+        *result = v;
         return true;
       }
     }
@@ -49,22 +25,20 @@ bool LockMVCCStorage::Read(Key key, Version** result, uint64 txn_unique_id, cons
 }
 
 void LockMVCCStorage::Lock(Key key, const TableType tbl_type) {
-  mutexs_[tbl_type][key]->Lock();
+  lock_mvcc_data_[tbl_type]->Find(key)->mutex_.Lock();
 }
 
 void LockMVCCStorage::Unlock(Key key, const TableType tbl_type) {
-  mutexs_[tbl_type][key]->Unlock();
+  lock_mvcc_data_[tbl_type]->Find(key)->mutex_.Unlock();
 }
 
 bool LockMVCCStorage::LockCheckWrite(Key key, uint64 txn_unique_id, const TableType tbl_type) {
 
-  if (lock_mvcc_data_[tbl_type].count(key)) {
-    deque<Version*>* data_versions_p = lock_mvcc_data_[tbl_type][key];
-
-    for (deque<Version*>::iterator it = data_versions_p->begin();
-         it != data_versions_p->end(); ++it) {
-      if ((*it)->version_id_ < txn_unique_id) {
-        if ((*it)->max_read_id_ <= txn_unique_id)
+  LockRecord* record = lock_mvcc_data_[tbl_type]->Find(key);
+  if (record != NULL) {
+    for (Version* v = record->versions_.Head(); v != NULL; v = v->Next()) {
+      if (v->version_id_ < txn_unique_id) {
+        if (v->max_read_id_ <= txn_unique_id)
           return true;
         else
           return false;
@@ -76,59 +50,88 @@ bool LockMVCCStorage::LockCheckWrite(Key key, uint64 txn_unique_id, const TableT
 
 void LockMVCCStorage::FinishWrite(Key key, Version* new_version, const TableType tbl_type) {
 
-  if (lock_mvcc_data_[tbl_type].count(key)) {
-    deque<Version*>* data_versions_p = lock_mvcc_data_[tbl_type][key];
-
-    for (deque<Version*>::iterator it = data_versions_p->begin();
-         it != data_versions_p->end(); ++it) {
-      if ((*it)->version_id_ <= new_version->version_id_) {
-        it = data_versions_p->insert(it, new_version);
-        return;
-      }
+  LockRecord* record = lock_mvcc_data_[tbl_type]->Find(key);
+  if (record != NULL) {
+    VersionChain* chain = &record->versions_;
+
+    // Versions are ordered by version_id_ here, never by their Timestamp
+    // words; stamp it in so that no version names the txn once it is done.
+    new_version->begin_id_.Store(new_version->version_id_);
+
+    // Keep the chain sorted by decreasing version_id_. The caller holds the
+    // record's lock, so nobody else can insert behind 'prev' concurrently.
+    Version* prev = NULL;
+    for (Version* v = chain->Head(); v != NULL; v = v->Next()) {
+      if (v->version_id_ <= new_version->version_id_)
+        break;
+      prev = v;
     }
-    data_versions_p->push_back(new_version);
+    if (prev == NULL)
+      chain->Push(new_version);
+    else
+      chain->InsertAfter(prev, new_version);
+    QueueForCollection(chain, key, tbl_type);
   }
   else {
     DIE("Unable to FinishWrite bc missing key");
   }
 }
 
-void LockMVCCStorage::InitStorage() {
-  TableType tbl = CHECKING;
-  unordered_map<Key, Mutex*> temp1;
-  unordered_map<Key, Mutex*> temp2;
-  mutexs_.push_back(temp1);
-  mutexs_.push_back(temp2);
-  lock_mvcc_data_.push_back(InitTable(tbl)); // Table for checking
-  tbl = SAVINGS;
-  lock_mvcc_data_.push_back(InitTable(tbl)); // Table for savings
+void LockMVCCStorage::CollectGarbage(uint64 low_watermark, vector<VersionRun>* garbage) {
+  int queued = gc_keys_.Size();
+  std::pair<TableType, Key> entry;
+  for (int i = 0; i < queued && gc_keys_.Pop(&entry); ++i) {
+    LockRecord* record = lock_mvcc_data_[entry.first]->Find(entry.second);
+    VersionChain* chain = &record->versions_;
+    chain->ClearCollectionMark();
+
+    // Every running txn reads a version at least as new as the first one
+    // below the watermark.
+    record->mutex_.Lock();
+    for (Version* v = chain->Head(); v != NULL; v = v->Next()) {
+      if (v->version_id_ < low_watermark) {
+        Version* next = v->Next();
+        if (next != NULL) {
+          v->next_.store(NULL, std::memory_order_release);
+          garbage->push_back(VersionRun(next, NULL));
+        }
+        break;
+      }
+    }
+    bool remaining = chain->Head()->Next() != NULL;
+    record->mutex_.Unlock();
+
+    if (remaining) {
+      QueueForCollection(chain, entry.second, entry.first);
+    }
+  }
+}
+
+void LockMVCCStorage::InitStorage(const Catalog& catalog, ThreadPool* tp) {
+  for (int tbl = 0; tbl < catalog.TableCount(); ++tbl) {
+    lock_mvcc_data_.push_back(InitLockTable(catalog.Spec(static_cast<TableType>(tbl))));
+  }
+  BulkLoad(catalog, tp);
 }
 
-unordered_map<Key, deque<Version*>*> LockMVCCStorage::InitTable(TableType tbl) {
+Table<LockRecord>* LockMVCCStorage::InitLockTable(const TableSpec& spec) {
+  // A table's keys are contiguous, so all of them live in the dense part.
+  return new Table<LockRecord>(spec.first_key_, spec.rows_);
+}
 
-  unordered_map<Key, deque<Version*>*> table_;
-  // TODO: set to 1000000
-  for (int i = 0; i < 1000000; ++i) {
-    table_[i] = new deque<Version*>();
-    Timestamp begin_ts = Timestamp{ 0, NULL, 0};
-    Timestamp end_ts = Timestamp{ INF_INT, NULL, 0};
+void LockMVCCStorage::LoadKeys(TableType tbl, Key first, Key last) {
+  Table<LockRecord>* table_ = lock_mvcc_data_[tbl];
 
-    Version* to_insert = new Version;
-    if (tbl == SAVINGS) {
-      to_insert->value_ = 5;
-    }
-    else {
-      to_insert->value_ = 0;
-    }
-    to_insert->begin_id_ = begin_ts;
-    to_insert->end_id_ = end_ts;
+  for (Key i = first; i < last; ++i) {
+    // Drawn from the allocator's free lists, so loading a fresh storage
+    // reuses the versions freed by one destroyed earlier.
+    Version* to_insert = SlabAllocator<Version>::New();
+    to_insert->value_ = InitialValue(tbl);
+    to_insert->begin_id_.Store(0);
+    to_insert->end_id_.Store(INF_INT);
     to_insert->version_id_ = 0;
     to_insert->max_read_id_ = 0;
-    mutexs_[tbl][i] = new Mutex();
 
-    table_[i]->push_front(to_insert);
+    table_->Insert(i)->versions_.Push(to_insert);
   }
-
-  return table_;
-
 }
@@ -6,10 +6,16 @@
 #include "txn/mvcc_storage.h"
 
 using std::unordered_map;
-using std::deque;
 using std::map;
 using std::vector;
 
+// A record of LockMVCCStorage: the key's version chain and the lock that
+// guards it, kept side by side so locking and reading touch the same line.
+struct LockRecord {
+  VersionChain versions_;
+  Mutex mutex_;
+};
+
 // TODO: Should create a parent abstract Storage class
 class LockMVCCStorage : public MVCCStorage {
  public:
@@ -27,10 +33,13 @@ class LockMVCCStorage : public MVCCStorage {
   void FinishWrite(Key key, Version* new_version, const TableType tbl_type = CHECKING);
 
   // Init storage
-  void InitStorage();
+  void InitStorage(const Catalog& catalog, ThreadPool* tp = NULL);
+
+  // Init storage table, sized for the records of 'spec' but still empty
+  Table<LockRecord>* InitLockTable(const TableSpec& spec);
 
-  // Init storage table
-  unordered_map<Key, deque<Version*>*> InitTable(TableType tbl);
+  // Inserts the initial version of every key in [first, last) of a table.
+  void LoadKeys(TableType tbl, Key first, Key last);
 
   // Lock the version_list of key
   void Lock(Key key, const TableType tbl_type);
@@ -38,17 +47,18 @@ class LockMVCCStorage : public MVCCStorage {
   // Unlock the version_list of key
   void Unlock(Key key, const TableType tbl_type);
 
+  // Cuts off every version older than the newest one with a version_id_
+  // below 'low_watermark', holding each record's lock while doing so.
+  void CollectGarbage(uint64 low_watermark, vector<VersionRun>* garbage);
+
   virtual ~LockMVCCStorage();
 
  private:
 
   friend class TxnProcessor;
 
-  // Storage for MVCC, each key has a linklist of versions
-  vector<unordered_map<Key, deque<Version*>*>> lock_mvcc_data_;
-
-  // Mutexs for each key
-  vector<unordered_map<Key, Mutex*>> mutexs_;
+  // Storage for MVCC, each key has a linklist of versions and its own mutex
+  vector<Table<LockRecord>*> lock_mvcc_data_;
 };
 
 
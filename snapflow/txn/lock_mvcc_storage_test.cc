@@ -0,0 +1,82 @@
+// Checks that garbage collection in the storage for MVCC mode cuts exactly
+// the versions no txn with a timestamp at or above the low watermark reads.
+
+#include "txn/lock_mvcc_storage.h"
+
+#include "utils/testing.h"
+
+// Writes 'value' to 'key' as the txn with timestamp 'ts' does.
+static void Install(LockMVCCStorage* storage, Key key, uint64 ts,
+                    Value value) {
+  Version* v = SlabAllocator<Version>::New();
+  v->value_ = value;
+  v->version_id_ = ts;
+  v->max_read_id_ = 0;
+  v->end_id_.Store(INF_INT);
+  storage->Lock(key, CHECKING);
+  storage->FinishWrite(key, v);
+  storage->Unlock(key, CHECKING);
+}
+
+// Returns the value of 'key' the txn with timestamp 'ts' reads, or -1 if it
+// finds none.
+static int ValueAt(LockMVCCStorage* storage, Key key, uint64 ts) {
+  Version* v;
+  if (!storage->Read(key, &v, ts))
+    return -1;
+  return static_cast<int>(v->value_);
+}
+
+// Frees the cut runs and returns how many versions they held.
+static int FreeGarbage(vector<VersionRun>* garbage) {
+  int count = 0;
+  for (size_t i = 0; i < garbage->size(); i++) {
+    VersionRun run = (*garbage)[i];
+    for (Version* v = run.first; v != NULL; v = v->Next()) {
+      count++;
+      if (v == run.second)
+        break;
+    }
+    VersionChain::FreeVersions(run.first, run.second);
+  }
+  garbage->clear();
+  return count;
+}
+
+TEST(CollectBelowWatermarkTest) {
+  Catalog catalog;
+  catalog.AddTable("checking", 10);
+  LockMVCCStorage storage;
+  storage.InitStorage(catalog);
+
+  Install(&storage, 3, 10, 1);
+  Install(&storage, 3, 30, 3);
+  // Written out of timestamp order, as MVCC allows.
+  Install(&storage, 3, 20, 2);
+  Install(&storage, 3, 40, 4);
+
+  // Oldest txn has timestamp 25: it reads the version from 20, but nobody
+  // reads the ones from 0 and 10.
+  vector<VersionRun> garbage;
+  storage.CollectGarbage(25, &garbage);
+  EXPECT_EQ(2, FreeGarbage(&garbage));
+  EXPECT_EQ(2, ValueAt(&storage, 3, 25));
+  EXPECT_EQ(3, ValueAt(&storage, 3, 35));
+  EXPECT_EQ(4, ValueAt(&storage, 3, 45));
+  EXPECT_EQ(-1, ValueAt(&storage, 3, 15));
+  // Other keys keep their only version.
+  EXPECT_EQ(0, ValueAt(&storage, 4, 25));
+
+  // The record stays queued, and its versions go once the txns move on.
+  storage.CollectGarbage(25, &garbage);
+  EXPECT_EQ(0, FreeGarbage(&garbage));
+  storage.CollectGarbage(45, &garbage);
+  EXPECT_EQ(2, FreeGarbage(&garbage));
+  EXPECT_EQ(4, ValueAt(&storage, 3, 45));
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  CollectBelowWatermarkTest();
+}
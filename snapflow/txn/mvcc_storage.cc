@@ -3,60 +3,81 @@
 
 #include "txn/mvcc_storage.h"
 
+#include <algorithm>
+
 // Init the storage
-void MVCCStorage::InitStorage() {
-  TableType tbl = CHECKING;
-  mvcc_data_.push_back(InitTable(tbl)); // Table for checking
-  tbl = SAVINGS;
-  mvcc_data_.push_back(InitTable(tbl)); // Table for savings
+void MVCCStorage::InitStorage(const Catalog& catalog, ThreadPool* tp) {
+  for (int tbl = 0; tbl < catalog.TableCount(); ++tbl) {
+    mvcc_data_.push_back(InitTable(catalog.Spec(static_cast<TableType>(tbl))));
+  }
+  BulkLoad(catalog, tp);
 }
 
 // Init the table
-unordered_map<Key, deque<Version*>*> MVCCStorage::InitTable(TableType tbl) {
-  unordered_map<Key, deque<Version*>*> table_;
+Table<VersionChain>* MVCCStorage::InitTable(const TableSpec& spec) {
+  // A table's keys are contiguous, so all of them live in the dense part.
+  return new Table<VersionChain>(spec.first_key_, spec.rows_);
+}
 
-  // TODO: set to 1000000
-  for (int i = 0; i < 1000000; ++i) {
-    table_[i] = new deque<Version*>();
-    Timestamp begin_ts = Timestamp{ 0, NULL, 0};
-    Timestamp end_ts = Timestamp{ INF_INT, NULL, 0};
+void MVCCStorage::LoadKeys(TableType tbl, Key first, Key last) {
+  Table<VersionChain>* table_ = mvcc_data_[tbl];
 
-    Version* to_insert = new Version;
-    if (tbl == SAVINGS) {
-      to_insert->value_ = 5;
-    }
-    else {
-      to_insert->value_ = 0;
-    }
-    to_insert->value_ = 0;
-    to_insert->begin_id_ = begin_ts;
-    to_insert->end_id_ = end_ts;
+  for (Key i = first; i < last; ++i) {
+    // Drawn from the allocator's free lists, so loading a fresh storage
+    // reuses the versions freed by one destroyed earlier.
+    Version* to_insert = SlabAllocator<Version>::New();
+    to_insert->value_ = InitialValue(tbl);
+    to_insert->begin_id_.Store(0);
+    to_insert->end_id_.Store(INF_INT);
+    to_insert->watcher_.store(0, std::memory_order_relaxed);
 
-    table_[i]->push_front(to_insert);
+    table_->Insert(i)->Push(to_insert);
   }
-
-  return table_;
 }
 
-// Free memory.
-MVCCStorage::~MVCCStorage() {
-  // clear checking table
-  if (!mvcc_data_.empty()) {
-    for (unordered_map<Key, deque<Version*>*>::iterator it = mvcc_data_[CHECKING].begin();
-         it != mvcc_data_[CHECKING].end(); ++it) {
-      delete it->second;
+void MVCCStorage::BulkLoad(const Catalog& catalog, ThreadPool* tp) {
+  if (tp == NULL) {
+    for (int tbl = 0; tbl < catalog.TableCount(); ++tbl) {
+      const TableSpec& spec = catalog.Spec(static_cast<TableType>(tbl));
+      LoadKeys(static_cast<TableType>(tbl), spec.first_key_,
+               spec.first_key_ + spec.rows_);
     }
+    return;
+  }
 
-    // clear savings table
-    for (unordered_map<Key, deque<Version*>*>::iterator it = mvcc_data_[SAVINGS].begin();
-         it != mvcc_data_[SAVINGS].end(); ++it) {
-      delete it->second;
+  std::atomic<int> pending(0);
+  for (int tbl = 0; tbl < catalog.TableCount(); ++tbl) {
+    const TableSpec& spec = catalog.Spec(static_cast<TableType>(tbl));
+    // Small tables get fewer slices, so that no slice is empty.
+    uint64 slices = std::min<uint64>(tp->ThreadCount(), spec.rows_);
+    for (uint64 i = 0; i < slices; ++i) {
+      Key first = spec.first_key_ + spec.rows_ * i / slices;
+      Key last = spec.first_key_ + spec.rows_ * (i + 1) / slices;
+      ++pending;
+      tp->RunTask(new Method<MVCCStorage, void, TableType, Key, Key, std::atomic<int>*>(
+            this,
+            &MVCCStorage::LoadSlice,
+            static_cast<TableType>(tbl), first, last, &pending));
     }
+  }
 
-    // clear storage
-    mvcc_data_.clear();
+  // Wait for all slices to be loaded.
+  while (pending > 0) {
+    Sleep(0.0001);
   }
+}
+
+void MVCCStorage::LoadSlice(TableType tbl, Key first, Key last, std::atomic<int>* pending) {
+  LoadKeys(tbl, first, last);
+  --*pending;
+}
 
+// Free memory.
+MVCCStorage::~MVCCStorage() {
+  for (size_t i = 0; i < mvcc_data_.size(); ++i) {
+    delete mvcc_data_[i];
+  }
+  mvcc_data_.clear();
 }
 
 // MVCC Read
@@ -82,17 +103,37 @@ MVCCStorage::~MVCCStorage() {
  *
  */
 
-uint64 MVCCStorage::GetBeginTimestamp(Version * v, uint64 my_id, Timestamp & ts, const bool& val) {
-  // What if ts.txn has committed and replaced itself?
-  // This requires that the txn keeps its pointer in the Txn field of the TS
-  ts.mutex_.Lock();
-  Txn * txn_p = (Txn*) ts.txn;
-  int status = txn_p->Status();
-  uint64 id = txn_p->GetStartID();
-  ts.mutex_.Unlock();
+bool MVCCStorage::LookupWriter(uint64 word, TxnStatus* status, uint64* end_id) {
+  // A COMMITTING txn is only between taking its end timestamp and publishing
+  // COMMITTED, so this never waits long.
+  while (true) {
+    if (!txn_status_.Lookup(Timestamp::TxnIdOf(word), status, end_id)) {
+      return false;
+    }
+    if (*status != COMMITTING) {
+      return true;
+    }
+    __builtin_ia32_pause();
+  }
+}
+
+uint64 MVCCStorage::GetBeginTimestamp(Version * v, uint64 my_id, uint64 word, const bool& val) {
+  TxnStatus status;
+  uint64 end_id;
+  while (Timestamp::IsTxn(word) && !LookupWriter(word, &status, &end_id)) {
+    // The writer has since stamped or detached the version; look again.
+    word = v->begin_id_.Load();
+  }
+  if (!Timestamp::IsTxn(word)) {
+    return word;
+  }
+  uint64 id = Timestamp::TxnIdOf(word);
 
   if (status == ACTIVE) {
-    if (id == my_id && v->end_id_.timestamp == INF_INT && !val) {
+    // v has no end timestamp yet: nobody has committed a newer version.
+    uint64 end = v->end_id_.Load();
+    bool open_ended = end == INF_INT || Timestamp::IsTxn(end);
+    if (id == my_id && open_ended && !val) {
       // v is visible
       return my_id;
     }
@@ -100,9 +141,9 @@ uint64 MVCCStorage::GetBeginTimestamp(Version * v, uint64 my_id, Timestamp & ts,
     // This means that if my_id (during validation my_id == end_unique_id) is
     // equal to the txn's end_unique_id, then we ignore it. This is to prevent
     // us reading our own version during validation.
-    else if (val && v->end_id_.timestamp == INF_INT && my_id != txn_p->GetEndID()) {
+    else if (val && open_ended && my_id != end_id) {
       // v is visible
-      return txn_p->GetEndID();
+      return end_id;
     }
     else {
       // v is not visible
@@ -111,7 +152,7 @@ uint64 MVCCStorage::GetBeginTimestamp(Version * v, uint64 my_id, Timestamp & ts,
   }
   // We could change the return depending on when the TS is "propagated".
   else if (status == COMMITTED) {
-    return txn_p->GetEndID();
+    return end_id;
   }
   else if (status == ABORTED) {
     return INF_INT;
@@ -120,20 +161,21 @@ uint64 MVCCStorage::GetBeginTimestamp(Version * v, uint64 my_id, Timestamp & ts,
 
 }
 
-uint64 MVCCStorage::GetEndTimestamp(Version * v, uint64 my_id, Timestamp & ts, const bool& val) {
-  // What if ts.txn has committed and replaced itself?
-  // This requires that the txn keeps its pointer in the Txn field of the TS
-  ts.mutex_.Lock();
-  Txn * txn_p = (Txn*) ts.txn;
-
-  TxnStatus status = txn_p->Status();
-  ts.mutex_.Unlock();
+uint64 MVCCStorage::GetEndTimestamp(Version * v, uint64 my_id, uint64 word, const bool& val) {
+  TxnStatus status;
+  uint64 end_id;
+  while (Timestamp::IsTxn(word) && !LookupWriter(word, &status, &end_id)) {
+    word = v->end_id_.Load();
+  }
+  if (!Timestamp::IsTxn(word)) {
+    return word;
+  }
 
   if (status == ACTIVE) {
       return INF_INT;
   }
   else if (status == COMMITTED) {
-    return txn_p->GetEndID();
+    return end_id;
   }
   else if (status == ABORTED) {
     return INF_INT;
@@ -143,46 +185,45 @@ uint64 MVCCStorage::GetEndTimestamp(Version * v, uint64 my_id, Timestamp & ts, c
 }
 
 bool MVCCStorage::Read(Key key, Version** result, uint64 txn_unique_id, const TableType tbl_type, const bool& val) {
-  if (mvcc_data_[tbl_type].count(key)) {
-    deque<Version*> * data_versions_p =  mvcc_data_[tbl_type][key];
+  return ReadAt(key, result, txn_unique_id, txn_unique_id, tbl_type, val);
+}
+
+bool MVCCStorage::ReadSnapshot(Key key, Version** result, uint64 ts, const TableType tbl_type) {
+  // No txn has id 0, so no version is taken for the reader's own.
+  return ReadAt(key, result, ts, 0, tbl_type, false);
+}
+
+bool MVCCStorage::ReadLatest(Key key, Version** result, const TableType tbl_type) {
+  // Every commit timestamp handed out is below INF_INT.
+  return ReadSnapshot(key, result, INF_INT - 1, tbl_type);
+}
+
+bool MVCCStorage::ReadAt(Key key, Version** result, uint64 ts, uint64 my_id, const TableType tbl_type, const bool& val) {
+  VersionChain* chain = mvcc_data_[tbl_type]->Find(key);
+  if (chain != NULL) {
+    // Fast path: most reads want the newest version, and if it is committed
+    // its timestamps need no further resolving.
+    Version* head = chain->HeadCommittedBy(ts);
+    if (head != NULL) {
+      *result = head;
+      return true;
+    }
+
     uint64 begin_ts, end_ts;
-    // This works under the assumption that we have the deque sorted in decreasing order
+    // This works under the assumption that the chain is sorted in decreasing order
     Version *right_version = NULL;
-    for (deque<Version*>::iterator it = data_versions_p->begin();
-      it != data_versions_p->end(); ++it) {
-
-      // Case 2:
-      if (*((*it)->begin_id_.edit_bit) == 1) {
-        begin_ts = GetBeginTimestamp(*it, txn_unique_id, (*it)->begin_id_, val);
-        if (!(*((*it)->end_id_.edit_bit) == 1)) {
-          end_ts = (*it)->end_id_.timestamp;
-        }
-        // Case 3:
-        else {
-          end_ts = GetEndTimestamp(*it, txn_unique_id, (*it)->end_id_, val);
-        }
-      }
-      else {
-        begin_ts = (*it)->begin_id_.timestamp;
-        // Case 3:
-        if (*((*it)->end_id_.edit_bit) == 1) {
-          end_ts = GetEndTimestamp(*it, txn_unique_id, (*it)->end_id_, val);
-        }
-        // Case 1:
-        else {
-          end_ts = (*it)->end_id_.timestamp;
-        }
-      }
+    for (Version* v = chain->Head(); v != NULL; v = v->Next()) {
+
+      // Case 1 is a plain timestamp; cases 2 and 3 (a txn still owns the
+      // word) are resolved through the owning txn.
+      begin_ts = GetBeginTimestamp(v, my_id, v->begin_id_.Load(), val);
+      end_ts = GetEndTimestamp(v, my_id, v->end_id_.Load(), val);
 
       // At the end, check using the timestamps found above:
-      if ((begin_ts <= txn_unique_id) && (end_ts > txn_unique_id)) {
-        right_version = (*it);
+      if ((begin_ts <= ts) && (end_ts > ts)) {
+        right_version = v;
         break;
       }
-      // else if ((*it)->begin_id_.timestamp == 0) {
-      //   Version *current_version = *it;
-      //   std::cout << "begin_id timestamp is 0" << std::endl;
-      // }
     }
     if (right_version == NULL) {
       return false;
@@ -199,50 +240,171 @@ bool MVCCStorage::Read(Key key, Version** result, uint64 txn_unique_id, const Ta
 // TODO: Change the end timestamp of old version, flip the bit, change
 // the begin timsteamp of new version and flip bit.
 void MVCCStorage::PutEndTimestamp(Version * old_version, Version * new_version, uint64 ts) {
-  if (old_version == NULL) {
-    std::cout << "HERE2" << std::endl;
+  DCHECK(old_version != NULL);
+  // Both words still name the committing txn, which is COMMITTED already, so
+  // readers see the same timestamps before and after each store.
+  old_version->end_id_.Store(ts);
+  new_version->begin_id_.Store(ts);
+
+  // Whoever decided something by reading the old version will likely have
+  // to start over. Pairs with the fence in Txn::Watch(): either we see the
+  // watcher, or it sees the end timestamp.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64 watcher = old_version->watcher_.load(std::memory_order_relaxed);
+  if (watcher != 0) {
+    txn_status_.Doom(watcher);
   }
-  old_version->end_id_.timestamp = ts;
-  new_version->begin_id_.timestamp = ts;
 
-  --old_version->end_id_.edit_bit;
-  --new_version->begin_id_.edit_bit;
+}
 
+bool MVCCStorage::Overwritten(Key key, Version* read, uint64 my_id, const TableType tbl_type) {
+  VersionChain* chain = mvcc_data_[tbl_type]->Find(key);
+  if (chain == NULL) {
+    return read != NULL;
+  }
+  // Timestamps alone cannot tell: in CSI a writer takes its commit timestamp
+  // before it validates, so a txn that starts later may still have read the
+  // version below it. Any other version above 'read' is one that committed,
+  // or still may.
+  uint64 mine = Timestamp::OfTxn(my_id);
+  for (Version* v = chain->Head(); v != NULL; v = v->Next()) {
+    uint64 begin = v->begin_id_.Load();
+    if (begin == INF_INT || begin == mine) {
+      continue;
+    }
+    return v != read;
+  }
+  return read != NULL;
 }
 
 // MVCC CheckWrite returns true if Write without conflict
 bool MVCCStorage::CheckWrite(Key key, Version* read_version, Txn* current_txn, const TableType tbl_type) {
-  deque<Version*> * data_p = mvcc_data_[tbl_type][key];
-  Version * front = data_p->front();
-
-  // TODO: Need to check read_version with front?
-
-  // mutex locks critical section of acquiring write priviledge
-  front->end_id_.mutex_.Lock();
-  if (*(front->end_id_.edit_bit) == 0) {
-    front->end_id_.edit_bit = 1;
-    front->end_id_.txn = current_txn;
-    front->end_id_.mutex_.Unlock();
-    // We leave the timestamp in the front->end_id_.timestamp as INF_INT
-    return true;
-  }
-  else {
-    Txn* old_txn = (Txn*)front->end_id_.txn;
-    if (old_txn && old_txn->Status() == ABORTED) {
-      front->end_id_.txn = (void*) current_txn;
-      front->end_id_.mutex_.Unlock();
-      return true;
+  // Versions of aborted writers are never visible, and the one at the head
+  // stays there until somebody installs a newer version.
+  Version * front = mvcc_data_[tbl_type]->Find(key)->Head();
+  while (front != NULL && front->begin_id_.Load() == INF_INT) {
+    front = front->Next();
+  }
+
+  // First updater wins: any version above the one we read was installed by
+  // a txn that has committed since we started, or still may. Overwriting it
+  // would lose that txn's update.
+  if (front != read_version) {
+    return false;
+  }
+
+  // Claim the right to overwrite 'front' by swapping ourselves into its end
+  // timestamp. We leave the timestamp as INF_INT until we commit.
+  uint64 end = front->end_id_.Load();
+  while (true) {
+    bool claimable = end == INF_INT;
+    if (Timestamp::IsTxn(end)) {
+      // We may take over the claim of a writer that has aborted.
+      TxnStatus status;
+      uint64 end_id;
+      if (!txn_status_.Lookup(Timestamp::TxnIdOf(end), &status, &end_id)) {
+        end = front->end_id_.Load();
+        continue;
+      }
+      claimable = status == ABORTED;
     }
-    else {
-      front->end_id_.mutex_.Unlock();
+
+    if (!claimable) {
       return false;
     }
+    if (front->end_id_.CompareAndSwap(end, Timestamp::OfTxn(current_txn->GetStartID()))) {
+      return true;
+    }
   }
-  return false;
 }
 
 void MVCCStorage::FinishWrite(Key key, Version* new_version, const TableType tbl_type) {
-  deque<Version*> * data_p = mvcc_data_[tbl_type][key];
-  data_p->push_front(new_version);
-  return;
+  VersionChain* chain = mvcc_data_[tbl_type]->Find(key);
+  chain->Push(new_version);
+  QueueForCollection(chain, key, tbl_type);
+}
+
+void MVCCStorage::ReleaseWrite(Key key, Txn* txn, const TableType tbl_type) {
+  // Giving up the right to overwrite a version leaves its end open, and a
+  // version we installed becomes invisible to everybody, so garbage
+  // collection will unlink it.
+  ReplaceTxnTimestamps(key, txn, INF_INT, tbl_type);
+}
+
+void MVCCStorage::SettleWrite(Key key, Txn* txn, const TableType tbl_type) {
+  ReplaceTxnTimestamps(key, txn, txn->GetEndID(), tbl_type);
+}
+
+void MVCCStorage::ReplaceTxnTimestamps(Key key, Txn* txn, uint64 ts, const TableType tbl_type) {
+  VersionChain* chain = mvcc_data_[tbl_type]->Find(key);
+  uint64 mine = Timestamp::OfTxn(txn->GetStartID());
+  for (Version* v = chain->Head(); v != NULL; v = v->Next()) {
+    uint64 expected = mine;
+    v->end_id_.CompareAndSwap(expected, ts);
+    expected = mine;
+    v->begin_id_.CompareAndSwap(expected, ts);
+  }
+}
+
+////////////////////////// GARBAGE COLLECTION ////////////////////////////////
+
+void MVCCStorage::QueueForCollection(VersionChain* chain, Key key, const TableType tbl_type) {
+  if (chain->MarkForCollection()) {
+    gc_keys_.Push(std::make_pair(tbl_type, key));
+  }
+}
+
+void MVCCStorage::CollectGarbage(uint64 low_watermark, vector<VersionRun>* garbage) {
+  // Only visit the keys queued before we started, so that chains requeued
+  // below wait for the next pass.
+  int queued = gc_keys_.Size();
+  std::pair<TableType, Key> entry;
+  for (int i = 0; i < queued && gc_keys_.Pop(&entry); ++i) {
+    VersionChain* chain = mvcc_data_[entry.first]->Find(entry.second);
+    chain->ClearCollectionMark();
+    CollectChain(chain, low_watermark, garbage);
+
+    // Anything left behind the head may become collectable later.
+    if (chain->Head()->Next() != NULL) {
+      QueueForCollection(chain, entry.second, entry.first);
+    }
+  }
+}
+
+/* Every transaction still running started at or after 'low_watermark', so
+ * the newest version committed at or before it (the base) is the oldest
+ * version any of them can read; everything behind the base is cut off.
+ * Versions whose writer aborted (begin timestamp INF_INT, see ReleaseWrite)
+ * are unlinked wherever they are.
+ *
+ * The head is never unlinked, so we never race with Push(). Garbage
+ * collection runs on a single thread, so nobody else changes a next_ link
+ * behind the head concurrently.
+ */
+void MVCCStorage::CollectChain(VersionChain* chain, uint64 low_watermark, vector<VersionRun>* garbage) {
+  Version* prev = NULL;
+  Version* v = chain->Head();
+  while (v != NULL) {
+    Version* next = v->Next();
+    uint64 begin = v->begin_id_.Load();
+    bool begin_final = !Timestamp::IsTxn(begin);
+
+    if (prev != NULL && begin_final && begin == INF_INT) {
+      // Aborted version
+      prev->next_.store(next, std::memory_order_release);
+      garbage->push_back(VersionRun(v, v));
+    }
+    else if (begin_final && begin <= low_watermark) {
+      // Base version
+      if (next != NULL) {
+        v->next_.store(NULL, std::memory_order_release);
+        garbage->push_back(VersionRun(next, NULL));
+      }
+      return;
+    }
+    else {
+      prev = v;
+    }
+    v = next;
+  }
 }
@@ -4,19 +4,152 @@
 #define _MVCC_STORAGE_H_
 
 #include <limits.h>
+#include <atomic>
 #include <unordered_map>
-#include <deque>
 #include <map>
 
+#include "txn/catalog.h"
 #include "txn/common.h"
 #include "txn/txn.h"
+#include "txn/txn_status_table.h"
+#include "utils/lockfree_queue.h"
 #include "utils/mutex.h"
+#include "utils/thread_pool.h"
 
 using std::unordered_map;
-using std::deque;
 using std::map;
 using std::vector;
 
+// Newest-first singly linked list of all versions of one record. Writers
+// publish a new head with a CAS on 'head_', so readers can walk the chain
+// without taking any latch and installing a version is O(1).
+class VersionChain {
+ public:
+  VersionChain() : head_(NULL), gc_pending_(false) {}
+
+  // Frees every version still linked into the chain.
+  ~VersionChain() {
+    Version* v = Head();
+    while (v != NULL) {
+      Version* next = v->Next();
+      SlabAllocator<Version>::Delete(v);
+      v = next;
+    }
+  }
+
+  // Returns the newest version of the record (NULL if the chain is empty).
+  Version* Head() const { return head_.load(std::memory_order_acquire); }
+
+  // Returns the head if it carries a commit timestamp no later than 'ts',
+  // else NULL. A writer installs its version before it takes its commit
+  // timestamp, so such a head is the version a txn with timestamp 'ts' reads:
+  // nothing newer can have committed before it, and the head's end stays open
+  // until a newer version is installed above it.
+  Version* HeadCommittedBy(uint64 ts) const {
+    Version* head = Head();
+    if (head == NULL) {
+      return NULL;
+    }
+    uint64 begin = head->begin_id_.Load();
+    return (!Timestamp::IsTxn(begin) && begin <= ts) ? head : NULL;
+  }
+
+  // Atomically installs 'v' as the newest version of the record.
+  void Push(Version* v) {
+    Version* head = head_.load(std::memory_order_relaxed);
+    do {
+      v->next_.store(head, std::memory_order_relaxed);
+    } while (!head_.compare_exchange_weak(head, v,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+  }
+
+  // Links 'v' directly behind 'prev'. Unlike Push this is not safe against
+  // concurrent inserts at the same position, so callers must hold the
+  // record's lock (see LockMVCCStorage).
+  void InsertAfter(Version* prev, Version* v) {
+    v->next_.store(prev->Next(), std::memory_order_relaxed);
+    prev->next_.store(v, std::memory_order_release);
+  }
+
+  // Flags the chain as waiting for garbage collection. Returns true if it was
+  // not flagged already, in which case the caller must queue it.
+  bool MarkForCollection() { return !gc_pending_.exchange(true); }
+
+  void ClearCollectionMark() { gc_pending_.store(false); }
+
+  // Frees the versions from 'first' through 'last', following next_ links.
+  // If 'last' is NULL, frees everything up to the end of the list.
+  static void FreeVersions(Version* first, Version* last) {
+    Version* v = first;
+    while (v != NULL) {
+      Version* next = (v == last) ? NULL : v->Next();
+      SlabAllocator<Version>::Delete(v);
+      v = next;
+    }
+  }
+
+ private:
+  std::atomic<Version*> head_;
+
+  // True while the chain sits in the storage's garbage collection queue.
+  std::atomic<bool> gc_pending_;
+};
+
+// A run of versions unlinked by garbage collection, to be freed with
+// VersionChain::FreeVersions(run.first, run.second) once no reader can still
+// be traversing it.
+typedef std::pair<Version*, Version*> VersionRun;
+
+// A table of records of type R. Keys in [first_key, first_key + size) are
+// stored densely in one array and found with a single index computation;
+// any other key falls back to a hash map. Records are only created while
+// the table is being loaded, so lookups need no synchronization.
+template<typename R>
+class Table {
+ public:
+  Table(Key first_key, uint64 size)
+      : first_key_(first_key), size_(size), dense_(new R[size]) {}
+
+  ~Table() {
+    delete[] dense_;
+    for (typename unordered_map<Key, R*>::iterator it = sparse_.begin();
+         it != sparse_.end(); ++it) {
+      delete it->second;
+    }
+  }
+
+  // Returns the record for 'key', or NULL if the key is not in the table.
+  inline R* Find(Key key) {
+    // Keys below first_key_ wrap around and fail the range check as well.
+    if (key - first_key_ < size_)
+      return &dense_[key - first_key_];
+    typename unordered_map<Key, R*>::iterator it = sparse_.find(key);
+    return it == sparse_.end() ? NULL : it->second;
+  }
+
+  // Returns the record for 'key', creating it in the sparse part of the table
+  // if needed. Only call this while loading the table; it is thread-safe for
+  // keys in the dense range only.
+  R* Insert(Key key) {
+    R* record = Find(key);
+    if (record == NULL) {
+      record = new R();
+      sparse_[key] = record;
+    }
+    return record;
+  }
+
+ private:
+  // Dense key range.
+  Key first_key_;
+  uint64 size_;
+  R* dense_;
+
+  // Records whose keys fall outside the dense range.
+  unordered_map<Key, R*> sparse_;
+};
+
 
 // MVCC storage
 class MVCCStorage {
@@ -26,7 +159,26 @@ class MVCCStorage {
   // The third parameter is the txn_unique_id(txn timestamp), which is used for MVCC.
   virtual bool Read(Key key, Version** result, uint64 txn_unique_id = 0, TableType tbl_type = CHECKING, const bool& val = 0);
 
-  // Check whether apply or abort the write
+  // Sets '*result' to the version of 'key' that was current at timestamp
+  // 'ts' and returns true, or returns false if there is none. For read-only
+  // txns, which have no writes of their own and need not hold a unique id:
+  // only waits for writers that are COMMITTING, and writes nothing.
+  bool ReadSnapshot(Key key, Version** result, uint64 ts, TableType tbl_type = CHECKING);
+
+  // ReadSnapshot() of the newest committed version of 'key'.
+  bool ReadLatest(Key key, Version** result, TableType tbl_type = CHECKING);
+
+  // Returns false if 'read' is still the newest version of 'key', not
+  // counting versions of aborted writers and of the txn with id 'my_id'. A
+  // writer installs its version before it takes its commit timestamp, so in
+  // that case nobody has committed the key since 'read' and a read of it
+  // (by 'my_id', at any timestamp up to now) returns 'read' again. Usually
+  // looks at the head of the chain only.
+  bool Overwritten(Key key, Version* read, uint64 my_id, TableType tbl_type = CHECKING);
+
+  // Claims for 'current_txn' the right to overwrite 'read_version', the
+  // version of 'key' it read. Returns false (and claims nothing) if that is
+  // no longer the newest version, or another live txn holds the claim.
   bool CheckWrite(Key key, Version* read_version, Txn* current_txn, TableType tbl_type = CHECKING);
 
   // Check whether apply or abort the write
@@ -36,11 +188,16 @@ class MVCCStorage {
   // The third parameter is the txn_unique_id(txn timestamp), which is used for MVCC.
   virtual void FinishWrite(Key key, Version* new_version, TableType tbl_type = CHECKING);
 
-  // Init storage of multiple tables
-  virtual void InitStorage();
+  // Init storage of every table in the catalog. If a thread pool is given,
+  // the initial versions are bulk loaded in parallel by its threads.
+  virtual void InitStorage(const Catalog& catalog, ThreadPool* tp = NULL);
 
-  // Init table
-  virtual unordered_map<Key, deque<Version*>*> InitTable(TableType tbl);
+  // Init table, sized for the records of 'spec' but still empty
+  virtual Table<VersionChain>* InitTable(const TableSpec& spec);
+
+  // Inserts the initial version of every key in [first, last) of a table.
+  // Slices of the same table may be loaded concurrently.
+  virtual void LoadKeys(TableType tbl, Key first, Key last);
 
   // Lock the version_list of key
   virtual void Lock(Key key, TableType tbl_type){};
@@ -48,28 +205,80 @@ class MVCCStorage {
   // Unlock the version_list of key
   virtual void Unlock(Key key, TableType tbl_type){};
 
-  // Get the start timestamp for a version and transaction id
-  uint64 GetBeginTimestamp(Version * v, uint64 my_id, Timestamp&, const bool& val = 0);
+  // Get the start timestamp for a version and transaction id, given the
+  // word loaded from v->begin_id_
+  uint64 GetBeginTimestamp(Version * v, uint64 my_id, uint64 word, const bool& val = 0);
+
+  // Get the end timestamp for a version and transaction id, given the word
+  // loaded from v->end_id_
+  uint64 GetEndTimestamp(Version * v, uint64 my_id, uint64 word, const bool& val = 0);
 
-  // Get the end timestamp for a version and transaction id
-  uint64 GetEndTimestamp(Version * v, uint64 my_id, Timestamp&, const bool& val = 0);
+  // Looks up the writer named by Timestamp 'word', waiting out COMMITTING
+  // so that its end timestamp is known if it commits. Returns false if the
+  // writer is done and 'word' is stale (see TxnStatusTable::Lookup).
+  bool LookupWriter(uint64 word, TxnStatus* status, uint64* end_id);
 
   // Put end timestamps into versions in storage
   void PutEndTimestamp(Version *, Version *, uint64);
 
+  // Detaches an aborted 'txn' from the versions of 'key': gives up its claim
+  // to overwrite the newest version (see CheckWrite) and marks any version it
+  // installed as never visible. Afterwards no version refers to 'txn'.
+  void ReleaseWrite(Key key, Txn* txn, TableType tbl_type = CHECKING);
+
+  // Stamps a committed 'txn''s end timestamp into every timestamp of 'key''s
+  // versions that still names it. Afterwards no version refers to 'txn'.
+  void SettleWrite(Key key, Txn* txn, TableType tbl_type = CHECKING);
+
+  // Unlinks, from the chains of recently written keys, every version that no
+  // transaction with a start timestamp of at least 'low_watermark' can read,
+  // and appends the unlinked runs to '*garbage'. Readers may still be
+  // traversing them, so the caller must defer freeing them until every
+  // transaction that was running at this point has finished.
+  virtual void CollectGarbage(uint64 low_watermark, vector<VersionRun>* garbage);
+
   virtual ~MVCCStorage();
 
+ protected:
+  // Value every record of table 'tbl' starts out with: savings accounts
+  // hold 5, enough to cover one check, and everything else 0. Shared by all
+  // storages so that every mode runs a workload from the same state.
+  static Value InitialValue(TableType tbl) { return tbl == SAVINGS ? 5 : 0; }
+
+  // Loads every key of every table in 'catalog', split into one slice per
+  // thread of 'tp' (or on the calling thread if 'tp' is NULL).
+  void BulkLoad(const Catalog& catalog, ThreadPool* tp);
+
+  // Thread pool task: loads one slice and counts down '*pending'.
+  void LoadSlice(TableType tbl, Key first, Key last, std::atomic<int>* pending);
+
+  // Queues 'key' to be looked at by the next CollectGarbage() pass. Called
+  // whenever a version is installed.
+  void QueueForCollection(VersionChain* chain, Key key, TableType tbl_type);
+
+  // Keys whose chains may hold collectable versions.
+  SegmentedQueue<std::pair<TableType, Key> > gc_keys_;
+
+  // Status of every txn that may be named by a Timestamp word. Maintained by
+  // the TxnProcessor.
+  TxnStatusTable txn_status_;
+
  private:
 
-  void SetTS(Timestamp & ts, int t, bool mode);
+  // Read() at timestamp 'ts' by the txn with id 'my_id', whose own
+  // uncommitted versions are visible to it.
+  bool ReadAt(Key key, Version** result, uint64 ts, uint64 my_id, TableType tbl_type, const bool& val);
+
+  // Replaces every timestamp of 'key''s versions that names 'txn' with 'ts'.
+  void ReplaceTxnTimestamps(Key key, Txn* txn, uint64 ts, TableType tbl_type);
 
-  void InitTS(Timestamp & ts);
+  // Unlinks collectable versions of a single chain.
+  void CollectChain(VersionChain* chain, uint64 low_watermark, vector<VersionRun>* garbage);
 
   friend class TxnProcessor;
 
-  // MVCC storage: vector of tables (maps with pointer to linked list of versions)
-  // TO DO: pointers to maps or just the maps?
-  vector<unordered_map<Key, deque<Version*>*>> mvcc_data_;
+  // MVCC storage: vector of tables, each holding one version chain per key
+  vector<Table<VersionChain>*> mvcc_data_;
 };
 
 #endif  // _MVCC_STORAGE_H_
@@ -0,0 +1,109 @@
+// Checks that garbage collection unlinks exactly the versions no reader at or
+// above the low watermark can see.
+
+#include "txn/mvcc_storage.h"
+
+#include "utils/testing.h"
+
+// Commits 'value' to 'key' at timestamp 'ts', as a writer that has settled
+// its timestamps would leave it.
+static void Install(MVCCStorage* storage, Key key, uint64 ts, Value value) {
+  Version* head;
+  storage->ReadLatest(key, &head);
+  Version* v = SlabAllocator<Version>::New();
+  v->value_ = value;
+  v->begin_id_.Store(ts);
+  v->end_id_.Store(INF_INT);
+  head->end_id_.Store(ts);
+  storage->FinishWrite(key, v);
+}
+
+// Returns the value of 'key' a reader at 'ts' sees, or -1 if it finds none.
+static int ValueAt(MVCCStorage* storage, Key key, uint64 ts) {
+  Version* v;
+  if (!storage->ReadSnapshot(key, &v, ts))
+    return -1;
+  return static_cast<int>(v->value_);
+}
+
+// Frees the unlinked runs and returns how many versions they held.
+static int FreeGarbage(vector<VersionRun>* garbage) {
+  int count = 0;
+  for (size_t i = 0; i < garbage->size(); i++) {
+    VersionRun run = (*garbage)[i];
+    for (Version* v = run.first; v != NULL; v = v->Next()) {
+      count++;
+      if (v == run.second)
+        break;
+    }
+    VersionChain::FreeVersions(run.first, run.second);
+  }
+  garbage->clear();
+  return count;
+}
+
+TEST(CollectBelowWatermarkTest) {
+  Catalog catalog;
+  catalog.AddTable("checking", 10);
+  MVCCStorage storage;
+  storage.InitStorage(catalog);
+
+  Install(&storage, 3, 10, 1);
+  Install(&storage, 3, 20, 2);
+  Install(&storage, 3, 30, 3);
+  Install(&storage, 3, 40, 4);
+
+  // Oldest reader started at 25: it needs the version from 20, but nobody
+  // needs the ones from 0 and 10.
+  vector<VersionRun> garbage;
+  storage.CollectGarbage(25, &garbage);
+  EXPECT_EQ(2, FreeGarbage(&garbage));
+  EXPECT_EQ(2, ValueAt(&storage, 3, 25));
+  EXPECT_EQ(3, ValueAt(&storage, 3, 35));
+  EXPECT_EQ(4, ValueAt(&storage, 3, 45));
+  EXPECT_EQ(-1, ValueAt(&storage, 3, 15));
+  // Other keys keep their only version.
+  EXPECT_EQ(0, ValueAt(&storage, 4, 25));
+
+  // The chain stays queued, and goes once the readers move on.
+  storage.CollectGarbage(25, &garbage);
+  EXPECT_EQ(0, FreeGarbage(&garbage));
+  storage.CollectGarbage(45, &garbage);
+  EXPECT_EQ(2, FreeGarbage(&garbage));
+  EXPECT_EQ(4, ValueAt(&storage, 3, 45));
+
+  END;
+}
+
+TEST(CollectAbortedTest) {
+  Catalog catalog;
+  catalog.AddTable("checking", 10);
+  MVCCStorage storage;
+  storage.InitStorage(catalog);
+
+  Install(&storage, 3, 10, 1);
+
+  // A version whose writer aborted, left behind the head by a later commit.
+  Version* aborted = SlabAllocator<Version>::New();
+  aborted->value_ = 99;
+  aborted->begin_id_.Store(INF_INT);
+  aborted->end_id_.Store(INF_INT);
+  storage.FinishWrite(3, aborted);
+  Install(&storage, 3, 20, 2);
+
+  // A reader at 5 still needs the initial version, so only the aborted one
+  // goes.
+  vector<VersionRun> garbage;
+  storage.CollectGarbage(5, &garbage);
+  EXPECT_EQ(1, FreeGarbage(&garbage));
+  EXPECT_EQ(0, ValueAt(&storage, 3, 5));
+  EXPECT_EQ(1, ValueAt(&storage, 3, 15));
+  EXPECT_EQ(2, ValueAt(&storage, 3, 25));
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  CollectBelowWatermarkTest();
+  CollectAbortedTest();
+}
@@ -1,8 +1,10 @@
 // Author: Alexander Thomson (thomson@cs.yale.edu)
 
 #include "txn/txn.h"
-uint64 INF_INT = std::numeric_limits<uint64>::max();
-bool Txn::Read(const Key& key, Value * value, const TableType& table, const bool& val) {
+
+#include "txn/mvcc_storage.h"
+uint64 INF_INT = std::numeric_limits<int64>::max();
+bool Txn::Read(const Key& key, Value * value, const TableType& table) {
   // Check that key is in readset/writeset.
   if (readset_[table].count(key) == 0 && writeset_[table].count(key) == 0)
     DIE("Invalid read (key not in readset or writeset).");
@@ -11,20 +13,22 @@ bool Txn::Read(const Key& key, Value * value, const TableType& table, const bool
   if (status_ != INCOMPLETE && status_ != ACTIVE)
     return false;
 
-  if (val) {
-    *value = vals_[table][key]->value_;
-    return true;
-  }
+  // Nor once we are going to be restarted anyway.
+  if (Doomed())
+    return false;
+
   // If we have previously written to key, then we read the newest local
   // version.
-  if (!val && writes_[table].count(key)) {
-    *value = writes_[table][key]->value_;
+  VersionMap::iterator it = writes_[table].find(key);
+  if (it != writes_[table].end()) {
+    *value = it->second->value_;
     return true;
   }
   // 'reads_' has already been populated by TxnProcessor, so it should contain
   // the target value iff the record appears in the database.
-  else if (reads_[table].count(key)) {
-    *value = reads_[table][key]->value_;
+  it = reads_[table].find(key);
+  if (it != reads_[table].end()) {
+    *value = it->second->value_;
     return true;
   }
   else {
@@ -33,26 +37,35 @@ bool Txn::Read(const Key& key, Value * value, const TableType& table, const bool
 }
 
 void Txn::Write(const Key& key, const Value& value, Version * to_insert, const TableType& table) {
+  if (read_only_)
+    DIE("Invalid write to key " << key << " (read-only txn).");
+
   // Check that key is in writeset.
   if (writeset_[table].count(key) == 0)
     DIE("Invalid write to key " << key << " (writeset).");
 
-  // Writes have no effect if we have already aborted or committed.
-  if (status_ != INCOMPLETE && status_ != ACTIVE)
+  // Writes have no effect if we have already aborted or committed, or are
+  // going to be restarted.
+  if ((status_ != INCOMPLETE && status_ != ACTIVE) || Doomed()) {
+    SlabAllocator<Version>::Delete(to_insert);
     return;
+  }
 
-  Timestamp begin_ts = Timestamp{INF_INT, this, 1}; // TODO: Figure out if this should be INF_INT or 0
-  Timestamp end_ts = Timestamp{INF_INT, NULL, 0};
-
+  // The version begins when this txn commits.
   to_insert->value_ = value;
-  to_insert->begin_id_ = begin_ts;
-  to_insert->end_id_ = end_ts;
+  to_insert->begin_id_.Store(Timestamp::OfTxn(unique_id_));
+  to_insert->end_id_.Store(INF_INT);
 
   // version_id_ and max_read_id_ for LockMVCCStorage
   to_insert->version_id_ = unique_id_;
   to_insert->max_read_id_ = 0;
-  // Set key-value pair in write buffer.
-  writes_[table][key] = to_insert;
+  to_insert->watcher_.store(0, std::memory_order_relaxed);
+  // Set key-value pair in write buffer, dropping any version we wrote to
+  // this key before.
+  Version*& slot = writes_[table][key];
+  if (slot != NULL)
+    SlabAllocator<Version>::Delete(slot);
+  slot = to_insert;
 
   // Also set key-value pair in read results in case txn logic requires the
   // record to be re-read.
@@ -68,14 +81,119 @@ void Txn::Write(const Key& key, const Value& value, Version * to_insert, const T
 //   }
 // }
 
+bool Txn::Check(const Predicate& predicate) {
+  Value values[PREDICATE_MAX_TERMS];
+  for (int i = 0; i < predicate.TermCount(); i++) {
+    const Predicate::Term& term = predicate.GetTerm(i);
+    if (readset_[term.table_].count(term.key_) == 0 &&
+        writeset_[term.table_].count(term.key_) == 0)
+      DIE("Invalid check of key " << term.key_
+          << " (not in readset or writeset).");
+    VersionMap::iterator it = reads_[term.table_].find(term.key_);
+    values[i] = it != reads_[term.table_].end() ? it->second->value_ : 0;
+    // Keys we write are ours until we finish (see CheckWrite), and watching
+    // them would take the watcher slot from somebody who can be doomed.
+    if (doom_word_ != NULL && it != reads_[term.table_].end() &&
+        writeset_[term.table_].count(term.key_) == 0)
+      Watch(it->second);
+  }
+
+  CheckedPredicate* checked = checks_.Append();
+  checked->predicate_ = predicate;
+  checked->outcome_ = predicate.Evaluate(values);
+
+  // The outcome no longer matters once we are doomed. Checking that only
+  // now lets Revalidate() cover this predicate too.
+  if (Doomed())
+    return false;
+  return checked->outcome_;
+}
+
+bool Txn::Validate() {
+  Value values[PREDICATE_MAX_TERMS];
+  for (size_t c = 0; c < checks_.Size(); c++) {
+    const CheckedPredicate& checked = checks_.Data()[c];
+    for (int i = 0; i < checked.predicate_.TermCount(); i++) {
+      const Predicate::Term& term = checked.predicate_.GetTerm(i);
+      VersionMap::iterator it = vals_[term.table_].find(term.key_);
+      values[i] = it != vals_[term.table_].end() && it->second != NULL
+                      ? it->second->value_ : 0;
+    }
+    if (checked.predicate_.Evaluate(values) != checked.outcome_)
+      return false;
+  }
+  return true;
+}
+
+void Txn::Watch(Version* version) {
+  // Pairs with the fence in MVCCStorage::PutEndTimestamp(): either the
+  // writer sees us watching, or we see its end timestamp. Claims alone do
+  // not doom anybody; two txns that each write what the other checks would
+  // doom each other.
+  version->watcher_.store(unique_id_, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64 end = version->end_id_.Load();
+  if (end != INF_INT && !Timestamp::IsTxn(end))
+    doom_word_->store(unique_id_, std::memory_order_relaxed);
+}
+
+bool Txn::Revalidate() {
+  // Take the doom back before looking, so that a writer committing over a
+  // version we are about to watch dooms us again.
+  doom_word_->store(0, std::memory_order_relaxed);
+
+  Value values[PREDICATE_MAX_TERMS];
+  for (size_t c = 0; c < checks_.Size(); c++) {
+    const CheckedPredicate& checked = checks_.Data()[c];
+    for (int i = 0; i < checked.predicate_.TermCount(); i++) {
+      const Predicate::Term& term = checked.predicate_.GetTerm(i);
+      VersionMap::iterator it = reads_[term.table_].find(term.key_);
+      Version* version = it != reads_[term.table_].end() ? it->second : NULL;
+      // As in Check(), keys we write cannot change under us.
+      if (version != NULL && writeset_[term.table_].count(term.key_) == 0 &&
+          storage_->ReadLatest(term.key_, &version, term.table_))
+        Watch(version);
+      values[i] = version != NULL ? version->value_ : 0;
+    }
+    if (checked.predicate_.Evaluate(values) != checked.outcome_)
+      return false;
+  }
+  return true;
+}
+
+void Txn::Restart() {
+  for (size_t tbl = 0; tbl < reads_.size(); ++tbl) {
+    reads_[tbl].clear();
+    writes_[tbl].clear();
+    vals_[tbl].clear();
+  }
+  checks_.Clear();
+  doom_word_ = NULL;
+  doomed_ = false;
+  status_ = INCOMPLETE;
+  ResetState();
+}
+
 void Txn::CopyTxnInternals(Txn* txn) const {
-  txn->readset_ = vector<set<Key>>(this->readset_);
-  txn->writeset_ = vector<set<Key>>(this->writeset_);
-  txn->reads_ = vector<map<Key, Version*>>(this->reads_);
-  txn->writes_ = vector<map<Key, Version*>>(this->writes_);
-  txn->vals_ = vector<map<Key, Version*>>(this->vals_);
-  txn->constraintset_ = set<Key>(this->constraintset_);
-  txn->status_ = this->status_;
+  // The containers are flat, so these are a few memcpy()s.
+  txn->readset_ = this->readset_;
+  txn->writeset_ = this->writeset_;
+  txn->reads_ = this->reads_;
+  txn->writes_ = this->writes_;
+  txn->vals_ = this->vals_;
+  txn->checks_ = this->checks_;
+  txn->status_ = this->status_.load();
   txn->unique_id_ = this->unique_id_;
   txn->end_unique_id_ = this->end_unique_id_;
+  txn->callback_ = this->callback_;
+  txn->retries_ = this->retries_;
+  txn->read_only_ = this->read_only_;
+}
+
+void Txn::InitPrivateSets(int table_count) {
+  readset_.resize(table_count);
+  writeset_.resize(table_count);
+  reads_.resize(table_count);
+  writes_.resize(table_count);
+  vals_.resize(table_count);
 }
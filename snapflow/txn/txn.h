@@ -4,17 +4,20 @@
 #ifndef _TXN_H_
 #define _TXN_H_
 
+#include <atomic>
 #include <map>
-#include <set>
 #include <vector>
 
 #include "txn/common.h"
 #include "utils/atomic.h"
+#include "utils/flat_set.h"
+#include "utils/slab_allocator.h"
+#include "utils/task.h"
 
 using std::map;
-using std::set;
 using std::vector;
-// The upper limit for ints.
+// The upper limit for ints. Also used as the timestamp of "never", so it
+// must not have TXN_BIT (see Timestamp) set.
 extern uint64 INF_INT;
 // Txns can have five distinct status values:
 enum TxnStatus {
@@ -23,47 +26,175 @@ enum TxnStatus {
   COMPLETED_C = 2,
   COMPLETED_A = 3,
   COMMITTED = 4,    // Committed
-  ABORTED = 5      // Aborted
-  // TODO add a PREPARING state?
+  ABORTED = 5,     // Aborted
+  COMMITTING = 6   // Taking its end timestamp; COMMITTED right after
 };
 
+// Set in a Timestamp word that names a writing txn rather than a timestamp.
+#define TXN_BIT (1ULL << 63)
+
+// Begin or end timestamp of a version, packed into a single atomic word so
+// that it is read with one load and claimed with one CAS. If TXN_BIT is clear
+// the word is the timestamp itself (INF_INT if there is none). If TXN_BIT is
+// set the rest of the word is the id of the txn that is writing the version,
+// and the timestamp follows from that txn's entry in the TxnStatusTable.
 struct Timestamp {
-  uint64 timestamp;
-  void* txn;
-  Atomic<int> edit_bit;
-  Mutex mutex_; // Mutex for setting txn in version end_id_ to txn that is overwriting
+  std::atomic<uint64> word_;
+
+  uint64 Load() const { return word_.load(std::memory_order_acquire); }
+  void Store(uint64 word) { word_.store(word, std::memory_order_release); }
+
+  // Replaces the word with 'desired' if it still equals 'expected'. On
+  // failure 'expected' is updated to the current word.
+  bool CompareAndSwap(uint64& expected, uint64 desired) {
+    return word_.compare_exchange_strong(expected, desired,
+                                         std::memory_order_acq_rel);
+  }
+
+  // Word naming the txn with id 'txn_id' as the writer.
+  static uint64 OfTxn(uint64 txn_id) { return TXN_BIT | txn_id; }
+  static bool IsTxn(uint64 word) { return (word & TXN_BIT) != 0; }
+  static uint64 TxnIdOf(uint64 word) { return word & ~TXN_BIT; }
 };
 
-// MVCC 'version' structure
+// MVCC 'version' structure. Versions are allocated with
+// SlabAllocator<Version> (see Txn::NewVersion()), never with new/delete.
+// Fields are ordered so that a chain traversal (next_, then the timestamps)
+// touches the first cache lines of each version.
 struct Version {
   Value value_;      // The value of this version
-  uint64 version_id_; // Used by LockMVCCStorage
-  uint64 max_read_id_; // Used by LockMVCCStorage
+
+  // Next (older) version of the same record. Set before the version is
+  // published to its VersionChain and only read afterwards.
+  std::atomic<Version*> next_;
+
   Timestamp begin_id_; // The timestamp of the earliest possible transaction to read/write this version
   Timestamp end_id_; // Timestamp of the latest possible transaction to read/write this version
+  uint64 version_id_; // Used by LockMVCCStorage
+  uint64 max_read_id_; // Used by LockMVCCStorage
+
+  // Id of the newest CSI txn whose checked predicates depend on this version
+  // (0 if none). The writer that ends the version dooms it (see
+  // Txn::Doomed()).
+  std::atomic<uint64> watcher_;
+
+  Version* Next() const { return next_.load(std::memory_order_acquire); }
 };
 
 // Moved this from mvcc_storage.h so that a txn is aware what table it needs to access
-// Table can either be checking or savings table
-enum TableType {
+// A table id is its index in the Catalog (see txn/catalog.h). The default
+// schema only has the checking and savings tables, but any id the catalog
+// hands out is a valid TableType.
+enum TableType : int {
   CHECKING = 0,  // checking storage
   SAVINGS = 1    // savings storage
 };
 
+// Keys a txn accesses in one table, and the versions it read or wrote there.
+// Txns rarely touch more than a handful of keys per table, so these are
+// sorted arrays, kept inline for up to 16 keys.
+typedef FlatSet<Key, 16> KeySet;
+typedef FlatMap<Key, Version*, 16> VersionMap;
+
+// Most records a single Predicate can depend on.
+#define PREDICATE_MAX_TERMS 4
+
+enum Comparison { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+// Linear constraint over records, sum(coefficient_i * value_i) <cmp> bound,
+// where value_i is the value of record (table_i, key_i). Txns evaluate them
+// with Txn::Check(). Predicates are plain data, so recording and
+// re-evaluating one allocates nothing. Built like
+//   Predicate(CMP_GE, 5).Plus(CHECKING, key).Plus(SAVINGS, key)
+class Predicate {
+ public:
+  struct Term {
+    TableType table_;
+    Key key_;
+    int64 coefficient_;
+  };
+
+  // The empty predicate, 0 == 0.
+  Predicate() : comparison_(CMP_EQ), bound_(0), term_count_(0) {}
+
+  Predicate(Comparison comparison, int64 bound)
+      : comparison_(comparison), bound_(bound), term_count_(0) {}
+
+  // Adds 'coefficient' times the value of 'key' in 'table' to the sum.
+  Predicate& Plus(TableType table, Key key, int64 coefficient = 1) {
+    DCHECK(term_count_ < PREDICATE_MAX_TERMS);
+    Term& term = terms_[term_count_++];
+    term.table_ = table;
+    term.key_ = key;
+    term.coefficient_ = coefficient;
+    return *this;
+  }
+
+  int TermCount() const { return term_count_; }
+  const Term& GetTerm(int i) const { return terms_[i]; }
+
+  // Evaluates the predicate, given the value of each term's record in term
+  // order. Values count as signed, so a balance overdrawn below zero is
+  // negative.
+  bool Evaluate(const Value* values) const {
+    int64 sum = 0;
+    for (int i = 0; i < term_count_; i++)
+      sum += terms_[i].coefficient_ * static_cast<int64>(values[i]);
+    switch (comparison_) {
+      case CMP_EQ: return sum == bound_;
+      case CMP_NE: return sum != bound_;
+      case CMP_LT: return sum < bound_;
+      case CMP_LE: return sum <= bound_;
+      case CMP_GT: return sum > bound_;
+      case CMP_GE: return sum >= bound_;
+    }
+    return false;
+  }
+
+ private:
+  Comparison comparison_;
+  int64 bound_;
+  int term_count_;
+  Term terms_[PREDICATE_MAX_TERMS];
+};
+
+// A predicate a txn evaluated while running, and what it evaluated to.
+struct CheckedPredicate {
+  Predicate predicate_;
+  bool outcome_;
+};
+
+class MVCCStorage;
+class Txn;
+class TxnProcessor;
+
+// Completion callback that can be handed to TxnProcessor::NewTxnRequest().
+// Done() runs on a worker thread once the txn has committed or aborted for
+// good, and takes ownership of the txn. It should be quick, since the worker
+// runs no other txn in the meantime.
+class TxnCallback {
+ public:
+  virtual ~TxnCallback() {}
+  virtual void Done(Txn* txn) = 0;
+};
+
 class Txn {
  public:
 
-  Txn() : status_(INCOMPLETE) {}
+  Txn() : status_(INCOMPLETE), callback_(NULL), finish_time_(0), retries_(0),
+          read_only_(false), doom_word_(NULL), storage_(NULL),
+          doomed_(false) {}
   virtual ~Txn() {}
   virtual Txn * clone() const = 0;    // Virtual constructor (copying)
 
   // Method containing all the transaction's method logic.
   virtual void Run() = 0;
 
-  // For txns not of type WriteCheck, this just returns true.
-  // For WriteCheck txns, this evaluates whether the original constraint path
-  // is the same at commit time. Called by TxnProcessor.
-  virtual bool Validate() { return true; }
+  // Called by TxnProcessor in CSI mode once the txn has its end timestamp and
+  // 'vals_' holds the records of every term of every Check() at that time.
+  // Returns true if each checked predicate still evaluates the way it did
+  // when the txn ran, i.e. the txn would have taken the same path.
+  virtual bool Validate();
 
   // Checks for overlap in read and write sets. If any key appears in both,
   // an error occurs.
@@ -76,14 +207,78 @@ class Txn {
 
   uint64 GetEndID() { return end_unique_id_; }
 
+  // Returns when (as per GetTime()) the TxnProcessor handed back the txn's
+  // result, for measuring how long the client took to pick it up.
+  double FinishTime() { return finish_time_; }
+
+  // Returns how many times the TxnProcessor restarted the txn after it
+  // aborted on a conflict.
+  int Retries() { return retries_; }
+
+  // Returns whether the txn declared that it never writes.
+  bool ReadOnly() { return read_only_; }
+
+  // Returns true once the txn is bound to fail validation (CSI only): another
+  // txn has committed a write over a version that one of the txn's checked
+  // predicates depends on, and re-evaluating the predicates on the newest
+  // committed versions changes an outcome. From then on Read(), Write() and
+  // Check() have no effect and the TxnProcessor restarts the txn as soon as
+  // Run() returns. Long-running Run() logic should poll this and return
+  // early.
+  bool Doomed() {
+    if (!doomed_ && doom_word_ != NULL &&
+        doom_word_->load(std::memory_order_relaxed) == unique_id_)
+      doomed_ = !Revalidate();
+    return doomed_;
+  }
+
  protected:
   // Copies the internals of this txn into a given transaction (i.e.
   // the readset, writeset, and so forth).  Be sure to modify this method
   // to copy any new data structures you create.
   void CopyTxnInternals(Txn* txn) const;
 
+  // Creates empty read/write sets and results for tables 0..table_count-1.
+  void InitPrivateSets(int table_count = 2);
+
+  // Puts the txn back into the state it was in before it first ran, so that
+  // the TxnProcessor can run the same object again after an abort. Keeps the
+  // read/write sets, the callback and the retry count. Requires that none of
+  // the txn's versions are reachable through 'writes_' any more (they have
+  // been freed, or released in storage).
+  void Restart();
+
+  // Clears whatever state of its own a subclass's Run() builds up. Called by
+  // Restart().
+  virtual void ResetState() {}
+
   friend class TxnProcessor;
 
+  // Method to be used inside 'Execute()' function to branch on a constraint
+  // over records. Evaluates 'predicate' over the records the txn read (not
+  // its own writes) and returns the outcome. In CSI mode the TxnProcessor
+  // re-evaluates the predicate at commit time and restarts the txn if the
+  // outcome changed, which rules out write skew on whatever the txn decided
+  // by it. A record that does not exist counts as 0.
+  //
+  // Requires: every term's key appears in the readset or writeset of its
+  // table
+  //
+  // Note: Can ONLY be called from inside the 'Execute()' function.
+  bool Check(const Predicate& predicate);
+
+  // Asks to be doomed when another txn commits a write over 'version', and
+  // dooms the txn right away if one already has.
+  void Watch(Version* version);
+
+  // Called once another txn has doomed us. Re-evaluates every checked
+  // predicate on the newest committed versions of its records, watching
+  // those instead, and returns true if no outcome changed. Overwrites that
+  // leave a predicate as it was are common (e.g. a deposit into an account
+  // whose balance was already known to cover a withdrawal), and need not
+  // cost a restart; validation still has the final say.
+  bool Revalidate();
+
   // Method to be used inside 'Execute()' function when reading records from
   // the database. If record corresponding with specified 'key' exists, sets
   // '*value' equal to the record value and returns true, else returns false.
@@ -91,10 +286,15 @@ class Txn {
   // Requires: key appears in readset or writeset
   //
   // Note: Can ONLY be called from inside the 'Execute()' function.
-  bool Read(const Key& key, Value* value, const TableType&, const bool& val = 0);
+  bool Read(const Key& key, Value* value, const TableType&);
+
+  // Method to be used inside 'Execute()' function to obtain a fresh version
+  // to pass to Write(). Versions come from a per-thread slab allocator, so
+  // this does not touch malloc.
+  Version* NewVersion() { return SlabAllocator<Version>::New(); }
 
   // Method to be used inside 'Execute()' function when writing records to
-  // the database.
+  // the database. The txn takes ownership of the Version passed in.
   //
   // Requires: key appears in writeset
   //
@@ -120,26 +320,28 @@ class Txn {
     } while (0)
 
   // Set of all keys that may need to be read in order to execute the
-  // transaction.
-  // The first entry is readset_chk_. The second is readset_sav_
-  vector<set<Key>> readset_;
+  // transaction, indexed by table id.
+  vector<KeySet> readset_;
 
   // Set of all keys that may be updated when executing the transaction.
-  vector<set<Key>> writeset_;
+  vector<KeySet> writeset_;
 
   // Results of reads performed by the transaction.
-  vector<map<Key, Version*>> reads_;
+  vector<VersionMap> reads_;
 
 
   // Key, Value pairs WRITTEN by the transaction.
-  vector<map<Key, Version*>> writes_;
+  vector<VersionMap> writes_;
 
-  vector<map<Key, Version*>> vals_;
+  // Records of the terms of 'checks_' as of the end timestamp, read for
+  // Validate().
+  vector<VersionMap> vals_;
 
-  set<Key> constraintset_;
+  // Predicates passed to Check() so far, in order, with their outcomes.
+  SmallArray<CheckedPredicate, 4> checks_;
 
   // Transaction's current execution status.
-  TxnStatus status_;
+  std::atomic<TxnStatus> status_;
 
   // Unique, monotonically increasing transaction ID, assigned by TxnProcessor.
   uint64 unique_id_;
@@ -147,6 +349,33 @@ class Txn {
   // Unique, monotonically increasing transaction ID, assigned by TxnProcessor.
   uint64 end_unique_id_;
 
+  // Called instead of queueing the result for GetTxnResult(), if not NULL.
+  TxnCallback* callback_;
+
+  // Set by TxnProcessor when the result is handed back.
+  double finish_time_;
+
+  // Number of restarts so far (see Retries()).
+  int retries_;
+
+  // Set by txns that never call Write(). In SI and CSI the TxnProcessor runs
+  // them at a snapshot, without taking timestamps or validating.
+  bool read_only_;
+
+  // The word of the txn's TxnStatusTable entry that is set to unique_id_
+  // when the txn is doomed. Set by TxnProcessor in CSI mode only.
+  std::atomic<uint64>* doom_word_;
+
+  // Storage that Revalidate() reads from. Set along with 'doom_word_'.
+  MVCCStorage* storage_;
+
+  // Set once Revalidate() has failed (see Doomed()).
+  bool doomed_;
+
+  // Task the scheduler hands to the thread pool to execute this txn, kept
+  // here so that dispatching a txn allocates nothing.
+  EmbeddedMethod<TxnProcessor, Txn*> dispatch_task_;
+
 };
 
 
@@ -5,13 +5,62 @@
 
 #include "txn/txn_processor.h"
 #include <stdio.h>
+#include <algorithm>
+#include <limits>
 #include <set>
+#include <thread>
 
-// Thread & queue counts for StaticThreadPool initialization.
-#define THREAD_COUNT 8
+// Bounds on how many times GetTxnResult() polls for a result before it
+// sleeps.
+#define RESULT_SPIN_MIN 16
+#define RESULT_SPIN_MAX 4096
 
-TxnProcessor::TxnProcessor(CCMode mode)
-    : mode_(mode), tp_(THREAD_COUNT), next_unique_id_(1) {
+// Longest time (in seconds) GetTxnResult() sleeps before polling again, as a
+// guard against missed wakeups.
+#define RESULT_WAIT_TIMEOUT 0.001
+
+// How many times an idle DISPATCH_DIRECT worker looks for a request before
+// it sleeps, on machines with more than one core.
+#define DISPATCH_SPIN_ROUNDS 64
+
+// Longest time (in seconds) an idle worker sleeps before looking again, as a
+// guard against missed wakeups.
+#define DISPATCH_WAIT_TIMEOUT 0.001
+
+// Request queue of the calling thread, if it is a DISPATCH_DIRECT worker.
+static thread_local int worker_shard = -1;
+
+// Seconds the garbage collector sleeps between passes.
+#define GC_INTERVAL 0.001
+
+TxnProcessor::TxnProcessor(CCMode mode, const Catalog& catalog,
+                           const ProcessorConfig& config)
+    : mode_(mode), catalog_(catalog),
+      placement_(CpuTopology::Detect().Place(
+          config.pinning_, config.workers_,
+          config.dispatch_ == DISPATCH_DIRECT ? COORDINATOR_UNPINNED
+                                              : config.scheduler_,
+          config.numa_node_)),
+      tp_(placement_.worker_cpus_.size(), placement_.worker_cpus_),
+      next_unique_id_(2), dispatch_(config.dispatch_), next_shard_(0),
+      admitting_(true), in_flight_(0), stopped_(false), pending_retries_(0),
+      next_retry_(std::numeric_limits<double>::max()), requests_seq_(0),
+      request_waiters_(0), results_seq_(0), result_waiters_(0), result_spin_(RESULT_SPIN_MIN),
+      next_active_slot_(0), gc_stopped_(false) {
+  result_spin_max_ =
+      std::thread::hardware_concurrency() > 1 ? RESULT_SPIN_MAX : 0;
+
+
+  request_shards_ = new SegmentedQueue<Txn*>[tp_.ThreadCount()];
+
+  owns_contention_ = config.contention_manager_ == NULL;
+  contention_ = owns_contention_ ? new BackoffManager()
+                                 : config.contention_manager_;
+
+  active_ = new ActiveTxnSlot[tp_.ThreadCount()];
+  for (int i = 0; i < tp_.ThreadCount(); i++) {
+    active_[i].start_id_ = 0;
+  }
 
   if (mode_ == MVCC) {
     storage_ = new LockMVCCStorage();
@@ -20,23 +69,32 @@ TxnProcessor::TxnProcessor(CCMode mode)
     storage_ = new MVCCStorage();
   }
 
-  storage_->InitStorage();
+  // Load the initial versions in parallel on the worker threads before any
+  // txn is scheduled on them.
+  double load_start = GetTime();
+  storage_->InitStorage(catalog_, &tp_);
+  load_time_ = GetTime() - load_start;
+  pthread_create(&gc_thread_, NULL, StartGarbageCollector, reinterpret_cast<void*>(this));
+
+  if (dispatch_ == DISPATCH_DIRECT) {
+    // Start one 'RunWorker()' loop per worker thread. A worker busy with a
+    // loop never picks up another task, so every thread gets exactly one.
+    for (int i = 0; i < tp_.ThreadCount(); i++) {
+      tp_.RunTask(new Method<TxnProcessor, void, int>(
+            this,
+            &TxnProcessor::RunWorker,
+            i));
+    }
+    return;
+  }
+
   // Start 'RunScheduler()' running.
-  cpu_set_t cpuset;
   pthread_attr_t attr;
   pthread_attr_init(&attr);
-  CPU_ZERO(&cpuset);
-  CPU_SET(0, &cpuset);
-  CPU_SET(1, &cpuset);
-  CPU_SET(2, &cpuset);
-  CPU_SET(3, &cpuset);
-  CPU_SET(4, &cpuset);
-  CPU_SET(5, &cpuset);
-  CPU_SET(6, &cpuset);
-  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
-  pthread_t scheduler_;
-  pthread_create(&scheduler_, &attr, StartScheduler, reinterpret_cast<void*>(this));
-
+  SetAffinity(&attr, placement_.coordinator_cpus_);
+  pthread_create(&scheduler_thread_, &attr, StartScheduler,
+                 reinterpret_cast<void*>(this));
+  pthread_attr_destroy(&attr);
 }
 
 void* TxnProcessor::StartScheduler(void * arg) {
@@ -44,32 +102,237 @@ void* TxnProcessor::StartScheduler(void * arg) {
   return NULL;
 }
 
+void* TxnProcessor::StartGarbageCollector(void * arg) {
+  reinterpret_cast<TxnProcessor *>(arg)->RunGarbageCollector();
+  return NULL;
+}
+
 TxnProcessor::~TxnProcessor() {
+  // Everything below is used by the background threads.
+  Stop();
+
+  // Nothing is reading storage any more, so everything retired can go.
+  for (deque<pair<uint64, VersionRun> >::iterator it = version_limbo_.begin();
+       it != version_limbo_.end(); ++it) {
+    VersionChain::FreeVersions(it->second.first, it->second.second);
+  }
 
   delete storage_;
+  delete[] active_;
+  delete[] request_shards_;
+  if (owns_contention_) {
+    delete contention_;
+  }
 }
 
-void TxnProcessor::NewTxnRequest(Txn* txn) {
-  // Atomically assign the txn a new number and add it to the incoming txn
-  // requests queue.
-  txn_requests_.Push(txn);
+bool TxnProcessor::Quiesce(double timeout) {
+  admitting_ = false;
+  double deadline = GetTime() + timeout;
+  while (in_flight_ > 0) {
+    if (timeout > 0 && GetTime() >= deadline) {
+      return false;
+    }
+    Sleep(0.0001);
+  }
+  return true;
 }
 
-Txn* TxnProcessor::GetTxnResult() {
+void TxnProcessor::Stop() {
+  if (stopped_.exchange(true)) {
+    return;
+  }
+
+  // Wake any worker sleeping in RunWorker() so it sees 'stopped_'.
+  requests_seq_++;
+  FutexWake(&requests_seq_, tp_.ThreadCount());
+  if (dispatch_ == DISPATCH_SCHEDULER) {
+    pthread_join(scheduler_thread_, NULL);
+  }
+  // Runs whatever the scheduler already handed to the pool, and waits for
+  // the worker loops to return.
+  tp_.Stop();
+
+  gc_stopped_ = true;
+  pthread_join(gc_thread_, NULL);
+}
+
+bool TxnProcessor::Admit(Txn* const* txns, int count) {
+  // Counting the txns before looking at 'admitting_' means that Quiesce()
+  // either waits for them or we see that it has been called.
+  in_flight_ += count;
+  if (admitting_) {
+    return true;
+  }
+  for (int i = 0; i < count; i++) {
+    txns[i]->status_ = ABORTED;
+    DeliverResult(txns[i]);
+  }
+  return false;
+}
+
+void TxnProcessor::NewTxnRequest(Txn* txn, TxnCallback* callback) {
+  DCHECK(txn->readset_.size() <= static_cast<size_t>(catalog_.TableCount()));
+  txn->callback_ = callback;
+  if (Admit(&txn, 1)) {
+    QueueRequest(txn);
+  }
+}
+
+void TxnProcessor::NewTxnRequests(Txn* const* txns, int count,
+                                  TxnCallback* callback) {
+  for (int i = 0; i < count; i++) {
+    DCHECK(txns[i]->readset_.size() <=
+           static_cast<size_t>(catalog_.TableCount()));
+    txns[i]->callback_ = callback;
+  }
+  if (!Admit(txns, count)) {
+    return;
+  }
+
+  if (dispatch_ == DISPATCH_SCHEDULER) {
+    txn_requests_.PushBatch(txns, count);
+    return;
+  }
+
+  // Split the batch over the request queues so that every worker has a
+  // share of it in its own queue.
+  int shards = tp_.ThreadCount();
+  int chunk = (count + shards - 1) / shards;
+  for (int first = 0; first < count; first += chunk) {
+    int shard = next_shard_++ % shards;
+    request_shards_[shard].PushBatch(txns + first,
+                                     std::min(chunk, count - first));
+  }
+  WakeWorkers(std::min(count, shards));
+}
+
+void TxnProcessor::QueueRequest(Txn* txn) {
+  if (dispatch_ == DISPATCH_SCHEDULER) {
+    txn_requests_.Push(txn);
+    return;
+  }
+
+  int shard = worker_shard;
+  if (shard < 0) {
+    shard = next_shard_++ % tp_.ThreadCount();
+  }
+  request_shards_[shard].Push(txn);
+  WakeWorkers(1);
+}
+
+void TxnProcessor::WakeWorkers(int count) {
+  if (request_waiters_.load() > 0) {
+    requests_seq_++;
+    FutexWake(&requests_seq_, count);
+  }
+}
+
+bool TxnProcessor::PopRequest(int shard, Txn** txn) {
+  int shards = tp_.ThreadCount();
+  for (int i = 0; i < shards; i++) {
+    if (request_shards_[(shard + i) % shards].Pop(txn)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void TxnProcessor::RunWorker(int shard) {
+  worker_shard = shard;
+  // Spinning only pays off if another core can queue requests meanwhile.
+  int spin = std::thread::hardware_concurrency() > 1 ? DISPATCH_SPIN_ROUNDS : 1;
+
   Txn* txn;
-  while (!txn_results_.Pop(&txn)) {
-    // No result yet. Wait a bit before trying again (to reduce contention on
-    // atomic queues).
-    sleep(0.000001);
+  while (!stopped_) {
+    bool found = false;
+    for (int i = 0; i < spin && !found; i++) {
+      found = PopRetry(&txn) || PopRequest(shard, &txn);
+    }
+
+    if (!found) {
+      // Same protocol as GetTxnResult(): register, look once more, sleep.
+      // Wake up in time for the next retry that falls due.
+      int seq = requests_seq_.load();
+      request_waiters_++;
+      found = PopRetry(&txn) || PopRequest(shard, &txn);
+      double timeout = DISPATCH_WAIT_TIMEOUT;
+      if (pending_retries_ > 0) {
+        timeout = std::min(timeout, next_retry_ - GetTime());
+      }
+      if (!found && !stopped_ && timeout > 0) {
+        FutexWait(&requests_seq_, seq, timeout);
+      }
+      request_waiters_--;
+    }
+
+    if (found) {
+      RunTxn(txn);
+    }
+  }
+}
+
+void TxnProcessor::RunTxn(Txn* txn) {
+  switch (mode_) {
+    case SI:                 SnapshotExecuteTxn(txn);  break;
+    case CSI:                CSIExecuteTxn(txn);       break;
+    case MVCC:               MVCCExecuteTxn(txn);      break;
   }
+}
+
+Txn* TxnProcessor::GetTxnResult() {
+  Txn* txn;
+  GetTxnResults(&txn, 1);
   return txn;
 }
 
+int TxnProcessor::GetTxnResults(Txn** txns, int max, double timeout) {
+  int found = txn_results_.PopBatch(txns, max);
+  if (found > 0 || timeout == 0)
+    return found;
+
+  // Results often arrive within a few microseconds, and polling for them is
+  // much cheaper than a sleep/wakeup round trip. Poll longer next time if
+  // that paid off, shorter if it did not.
+  int spin = std::min(result_spin_.load(std::memory_order_relaxed),
+                      result_spin_max_);
+  for (int i = 0; i < spin; i++) {
+    found = txn_results_.PopBatch(txns, max);
+    if (found > 0) {
+      result_spin_.store(std::min(2 * spin, RESULT_SPIN_MAX),
+                         std::memory_order_relaxed);
+      return found;
+    }
+  }
+  result_spin_.store(std::max(spin / 2, RESULT_SPIN_MIN),
+                     std::memory_order_relaxed);
+
+  // Sleep until FinishTxn() queues a result. Registering as a waiter before
+  // the last check means FinishTxn() either sees us and wakes us, or queued
+  // its result early enough for that check to find it.
+  double deadline = GetTime() + timeout;
+  while (true) {
+    double wait = RESULT_WAIT_TIMEOUT;
+    if (timeout > 0) {
+      wait = std::min(wait, deadline - GetTime());
+    }
+    int seq = results_seq_.load();
+    result_waiters_++;
+    found = txn_results_.PopBatch(txns, max);
+    if (found == 0 && wait > 0)
+      FutexWait(&results_seq_, seq, wait);
+    result_waiters_--;
+    if (found == 0)
+      found = txn_results_.PopBatch(txns, max);
+    if (found > 0 || (timeout > 0 && GetTime() >= deadline))
+      return found;
+  }
+}
+
 void TxnProcessor::RunScheduler() {
   switch (mode_) {
-    case SI:                 RunSnapshotScheduler();
-    case CSI:                RunCSIScheduler();
-    case MVCC:               RunMVCCScheduler();
+    case SI:                 RunSnapshotScheduler();  break;
+    case CSI:                RunCSIScheduler();       break;
+    case MVCC:               RunMVCCScheduler();      break;
   }
 }
 
@@ -77,17 +340,12 @@ void TxnProcessor::RunScheduler() {
 
 bool TxnProcessor::MVCCCheckWrites(Txn* txn) {
     //   Call MVCCStorage::CheckWrite method to check all keys in the write_set_
-  for (set<Key>::iterator it = txn->writeset_[CHECKING].begin();
-       it != txn->writeset_[CHECKING].end(); ++it) {
-    if (!storage_->LockCheckWrite(*it, txn->unique_id_, CHECKING)) {
-      return false;
-    }
-  }
-
-  for (set<Key>::iterator it = txn->writeset_[SAVINGS].begin();
-       it != txn->writeset_[SAVINGS].end(); ++it) {
-    if (!storage_->LockCheckWrite(*it, txn->unique_id_, SAVINGS)) {
-      return false;
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+         it != txn->writeset_[tbl].end(); ++it) {
+      if (!storage_->LockCheckWrite(*it, txn->unique_id_, static_cast<TableType>(tbl))) {
+        return false;
+      }
     }
   }
   return true;
@@ -95,79 +353,55 @@ bool TxnProcessor::MVCCCheckWrites(Txn* txn) {
 
 void TxnProcessor::MVCCLockWriteKeys(Txn* txn) {
   //   Acquire all locks for keys in the write_set_
-  for (set<Key>::iterator it = txn->writeset_[CHECKING].begin();
-             it != txn->writeset_[CHECKING].end(); ++it) {
-    storage_->Lock(*it, CHECKING);
-  }
-  for (set<Key>::iterator it = txn->writeset_[SAVINGS].begin();
-             it != txn->writeset_[SAVINGS].end(); ++it) {
-    storage_->Lock(*it, SAVINGS);
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+               it != txn->writeset_[tbl].end(); ++it) {
+      storage_->Lock(*it, static_cast<TableType>(tbl));
+    }
   }
 }
 
 void TxnProcessor::MVCCUnlockWriteKeys(Txn* txn) {
     //   Acquire all locks for keys in the write_set_
-  for (set<Key>::iterator it = txn->writeset_[CHECKING].begin();
-             it != txn->writeset_[CHECKING].end(); ++it) {
-    storage_->Unlock(*it, CHECKING);
-  }
-  for (set<Key>::iterator it = txn->writeset_[SAVINGS].begin();
-             it != txn->writeset_[SAVINGS].end(); ++it) {
-    storage_->Unlock(*it, SAVINGS);
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+               it != txn->writeset_[tbl].end(); ++it) {
+      storage_->Unlock(*it, static_cast<TableType>(tbl));
+    }
   }
 }
 
 void TxnProcessor::MVCCPerformReads(Txn* txn) {
-  for (set<Key>::iterator it = txn->readset_[CHECKING].begin();
-       it != txn->readset_[CHECKING].end(); ++it) {
-
-    storage_->Lock(*it, CHECKING);
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, CHECKING))
-      txn->reads_[CHECKING][*it] = result;
-    storage_->Unlock(*it, CHECKING);
-  }
-
-  for (set<Key>::iterator it = txn->readset_[SAVINGS].begin();
-       it != txn->readset_[SAVINGS].end(); ++it) {
-
-    storage_->Lock(*it, SAVINGS);
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, SAVINGS))
-      txn->reads_[SAVINGS][*it] = result;
-    storage_->Unlock(*it, SAVINGS);
-  }
-
-  for (set<Key>::iterator it = txn->writeset_[CHECKING].begin();
-       it != txn->writeset_[CHECKING].end(); ++it) {
-
-    storage_->Lock(*it, CHECKING);
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, CHECKING))
-      txn->reads_[CHECKING][*it] = result;
-    storage_->Unlock(*it, CHECKING);
-  }
+  for (size_t tbl = 0; tbl < txn->readset_.size(); ++tbl) {
+    TableType table = static_cast<TableType>(tbl);
+    for (KeySet::iterator it = txn->readset_[tbl].begin();
+         it != txn->readset_[tbl].end(); ++it) {
+
+      storage_->Lock(*it, table);
+      Version * result = NULL;
+      if (storage_->Read(*it, &result, txn->unique_id_, table))
+        txn->reads_[tbl][*it] = result;
+      storage_->Unlock(*it, table);
+    }
 
-  for (set<Key>::iterator it = txn->writeset_[SAVINGS].begin();
-       it != txn->writeset_[SAVINGS].end(); ++it) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+         it != txn->writeset_[tbl].end(); ++it) {
 
-    storage_->Lock(*it, SAVINGS);
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, SAVINGS))
-      txn->reads_[SAVINGS][*it] = result;
-    storage_->Unlock(*it, SAVINGS);
+      storage_->Lock(*it, table);
+      Version * result = NULL;
+      if (storage_->Read(*it, &result, txn->unique_id_, table))
+        txn->reads_[tbl][*it] = result;
+      storage_->Unlock(*it, table);
+    }
   }
 }
 
 void TxnProcessor::MVCCFinishWrites(Txn* txn) {
-  for (map<Key, Version*>::iterator it = txn->writes_[CHECKING].begin();
-       it != txn->writes_[CHECKING].end(); ++it) {
-    storage_->FinishWrite(it->first, it->second, CHECKING);
-  }
-
-  for (map<Key, Version*>::iterator it = txn->writes_[SAVINGS].begin();
-       it != txn->writes_[SAVINGS].end(); ++it) {
-    storage_->FinishWrite(it->first, it->second, SAVINGS);
+  for (size_t tbl = 0; tbl < txn->writes_.size(); ++tbl) {
+    for (VersionMap::iterator it = txn->writes_[tbl].begin();
+         it != txn->writes_[tbl].end(); ++it) {
+      storage_->FinishWrite(it->first, it->second, static_cast<TableType>(tbl));
+    }
   }
 }
 
@@ -191,17 +425,15 @@ void TxnProcessor::MVCCExecuteTxn(Txn* txn) {
     MVCCUnlockWriteKeys(txn);
 
     // Mark txn as committed
-    txn->status_ = COMMITTED;
-    txn_results_.Push(txn);
+    SetStatus(txn, COMMITTED);
+    FinishTxn(txn);
 
   } else {
     MVCCUnlockWriteKeys(txn);
 
-    EmptyReadWrites(txn);
-    txn->status_ = ABORTED;
-    Txn* copy = txn->clone();
-    copy->status_ = INCOMPLETE;
-    txn_requests_.Push(copy);
+    // None of the new versions made it into storage.
+    FreeWrites(txn);
+    RestartTxn(txn);
 
   }
 
@@ -211,12 +443,10 @@ void TxnProcessor::MVCCExecuteTxn(Txn* txn) {
 void TxnProcessor::RunMVCCScheduler() {
   Txn* txn;
 
-  while (tp_.Active()) {
-    if (txn_requests_.Pop(&txn)) {
-      tp_.RunTask(new Method<TxnProcessor, void, Txn*>(
-            this,
-            &TxnProcessor::MVCCExecuteTxn,
-            txn));
+  while (!stopped_) {
+    if (PopRetry(&txn) || txn_requests_.Pop(&txn)) {
+      txn->dispatch_task_.Set(this, &TxnProcessor::MVCCExecuteTxn, txn);
+      tp_.RunTask(&txn->dispatch_task_);
     }
   }
 }
@@ -227,189 +457,324 @@ void TxnProcessor::RunMVCCScheduler() {
 
 void TxnProcessor::GetBeginTimestamp(Txn* txn) {
 
-  mutex_.Lock();
-  txn->unique_id_ = next_unique_id_;
+  ActiveTxnSlot* slot = ActiveSlot();
+
+  // Publish a lower bound of our start timestamp before taking it, so
+  // LowWatermark() cannot miss us.
+  slot->start_id_ = next_unique_id_.load();
+  txn->unique_id_ = next_unique_id_.fetch_add(1);
+  storage_->txn_status_.Begin(txn->unique_id_);
   // This might be a race condition from CheckWrite in mvcc_storage when checking ABORTED
   txn->status_ = ACTIVE;
-  next_unique_id_++;
-  mutex_.Unlock();
+  slot->start_id_ = txn->unique_id_;
 }
 
 void TxnProcessor::GetEndTimestamp(Txn* txn, const bool& val) {
 
-  mutex_.Lock();
-  txn->end_unique_id_ = next_unique_id_;
   if (!val) {
-    txn->status_ = COMMITTED;
+    // Anyone who takes a timestamp after ours will see at least COMMITTING,
+    // and waits for COMMITTED (see MVCCStorage::LookupWriter).
+    SetStatus(txn, COMMITTING);
+  }
+  txn->end_unique_id_ = next_unique_id_.fetch_add(1);
+  storage_->txn_status_.SetEndID(txn->unique_id_, txn->end_unique_id_);
+  if (!val) {
+    SetStatus(txn, COMMITTED);
   }
-  next_unique_id_++;
-  mutex_.Unlock();
 }
 
 bool TxnProcessor::GetReads(Txn* txn) {
 
-  for (set<Key>::iterator it = txn->readset_[CHECKING].begin();
-     it != txn->readset_[CHECKING].end(); ++it) {
+  for (size_t tbl = 0; tbl < txn->readset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->readset_[tbl].begin();
+       it != txn->readset_[tbl].end(); ++it) {
 
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, CHECKING)) {
-      txn->reads_[CHECKING][*it] = result;
-    }
-    else {
-      return false;
-    }
-  }
-
-  for (set<Key>::iterator it = txn->readset_[SAVINGS].begin();
-     it != txn->readset_[SAVINGS].end(); ++it) {
-
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, SAVINGS)) {
-      txn->reads_[SAVINGS][*it] = result;
-    }
-    else {
-      return false;
+      Version * result = NULL;
+      if (storage_->Read(*it, &result, txn->unique_id_, static_cast<TableType>(tbl))) {
+        txn->reads_[tbl][*it] = result;
+      }
+      else {
+        return false;
+      }
     }
   }
   return true;
 }
 
 void TxnProcessor::GetValidationReads(Txn* txn) {
-  for (set<Key>::iterator it = txn->constraintset_.begin();
-     it != txn->constraintset_.end(); ++it) {
-
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->end_unique_id_, CHECKING, true)) {
-      txn->vals_[CHECKING][*it] = result;
-    }
-    result = NULL;
-    if (storage_->Read(*it, &result, txn->end_unique_id_, SAVINGS, true)) {
-      txn->vals_[SAVINGS][*it] = result;
+  // Only the records the txn's checked predicates depend on, each once.
+  // Records nobody has overwritten since the txn read them still hold what
+  // it read, so only the others are looked up again at the end timestamp.
+  for (size_t c = 0; c < txn->checks_.Size(); c++) {
+    const Predicate& predicate = txn->checks_.Data()[c].predicate_;
+    for (int i = 0; i < predicate.TermCount(); i++) {
+      const Predicate::Term& term = predicate.GetTerm(i);
+      if (txn->vals_[term.table_].count(term.key_))
+        continue;
+      VersionMap::iterator it = txn->reads_[term.table_].find(term.key_);
+      Version * result = it != txn->reads_[term.table_].end() ? it->second : NULL;
+      if (result != NULL &&
+          !storage_->Overwritten(term.key_, result, txn->unique_id_, term.table_)) {
+        txn->vals_[term.table_][term.key_] = result;
+      }
+      else if (storage_->Read(term.key_, &result, txn->end_unique_id_, term.table_, true)) {
+        txn->vals_[term.table_][term.key_] = result;
+      }
     }
-
   }
 }
 
 bool TxnProcessor::CheckWrites(Txn* txn) {
 
-  for (set<Key>::iterator it = txn->writeset_[CHECKING].begin();
-     it != txn->writeset_[CHECKING].end(); ++it) {
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    TableType table = static_cast<TableType>(tbl);
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+       it != txn->writeset_[tbl].end(); ++it) {
 
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, CHECKING)) {
-      txn->reads_[CHECKING][*it] = result;
+      Version * result = NULL;
+      if (storage_->Read(*it, &result, txn->unique_id_, table)) {
+        txn->reads_[tbl][*it] = result;
 
-      if (!storage_->CheckWrite(*it, result, txn, CHECKING)) {
+        if (!storage_->CheckWrite(*it, result, txn, table)) {
+          return false;
+        }
+      }
+      else {
         return false;
       }
     }
-    else {
-      // std::cout << "Did not find valid version for key: " << *it << std::endl;
-      // storage_->Read(*it, &result, txn->unique_id_, CHECKING);
-      return false;
-    }
   }
+  return true;
 
-  for (set<Key>::iterator it = txn->writeset_[SAVINGS].begin();
-     it != txn->writeset_[SAVINGS].end(); ++it) {
+}
 
-    Version * result = NULL;
-    if (storage_->Read(*it, &result, txn->unique_id_, SAVINGS)) {
-      txn->reads_[SAVINGS][*it] = result;
+void TxnProcessor::FinishWrites(Txn* txn) {
+
+  for (size_t tbl = 0; tbl < txn->writes_.size(); ++tbl) {
+    for (VersionMap::iterator it = txn->writes_[tbl].begin();
+       it != txn->writes_[tbl].end(); ++it) {
+
+      // first is pointer to version, 2nd is txn
+      storage_->FinishWrite(it->first, it->second, static_cast<TableType>(tbl));
 
-      if (!storage_->CheckWrite(*it, result, txn, SAVINGS)) {
-        return false;
-      }
-    }
-    else {
-      return false;
     }
   }
-  return true;
 
 }
 
-void TxnProcessor::FinishWrites(Txn* txn) {
+void TxnProcessor::PutEndTimestamps(Txn* txn) {
 
-  for (map<Key, Version*>::iterator it = txn->writes_[CHECKING].begin();
-     it != txn->writes_[CHECKING].end(); ++it) {
+  for (size_t tbl = 0; tbl < txn->writes_.size(); ++tbl) {
+    for (VersionMap::iterator it = txn->writes_[tbl].begin();
+       it != txn->writes_[tbl].end(); ++it) {
 
-    // first is pointer to version, 2nd is txn
-    storage_->FinishWrite(it->first, it->second, CHECKING);
+      // CheckWrites() claimed the version we read of every key we write.
+      VersionMap::iterator read = txn->reads_[tbl].find(it->first);
+      DCHECK(read != txn->reads_[tbl].end() && read->second != NULL);
+      // second is the old version here, and the new version in 'it'
+      storage_->PutEndTimestamp(read->second, it->second, txn->end_unique_id_);
 
+    }
   }
 
-  for (map<Key, Version*>::iterator it = txn->writes_[SAVINGS].begin();
-     it != txn->writes_[SAVINGS].end(); ++it) {
-
-    // first is pointer to version, 2nd is txn
-    storage_->FinishWrite(it->first, it->second, SAVINGS);
+}
 
+void TxnProcessor::EmptyReadWrites(Txn* txn) {
+  for (size_t tbl = 0; tbl < txn->reads_.size(); ++tbl) {
+    txn->reads_[tbl].clear();
+    txn->writes_[tbl].clear();
+    txn->vals_[tbl].clear();
   }
 
 }
 
-void TxnProcessor::PutEndTimestamps(Txn* txn) {
+void TxnProcessor::ReleaseWrites(Txn* txn) {
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+         it != txn->writeset_[tbl].end(); ++it) {
+      storage_->ReleaseWrite(*it, txn, static_cast<TableType>(tbl));
+    }
+  }
+}
 
-  for (map<Key, Version*>::iterator it = txn->writes_[CHECKING].begin();
-     it != txn->writes_[CHECKING].end(); ++it) {
+void TxnProcessor::SettleWrites(Txn* txn) {
+  for (size_t tbl = 0; tbl < txn->writeset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->writeset_[tbl].begin();
+         it != txn->writeset_[tbl].end(); ++it) {
+      storage_->SettleWrite(*it, txn, static_cast<TableType>(tbl));
+    }
+  }
+}
 
-    if (txn->reads_[CHECKING][it->first] == NULL) {
-      std::cout << "HERE" << std::endl;
+void TxnProcessor::FreeWrites(Txn* txn) {
+  for (size_t tbl = 0; tbl < txn->writes_.size(); ++tbl) {
+    for (VersionMap::iterator it = txn->writes_[tbl].begin();
+         it != txn->writes_[tbl].end(); ++it) {
+      SlabAllocator<Version>::Delete(it->second);
     }
-    // first is the old version, 2nd is new version
-    storage_->PutEndTimestamp(txn->reads_[CHECKING][it->first], txn->writes_[CHECKING][it->first], txn->end_unique_id_);
+    txn->writes_[tbl].clear();
+  }
+}
+
+void TxnProcessor::SetStatus(Txn* txn, TxnStatus status) {
+  txn->status_ = status;
+  storage_->txn_status_.SetStatus(txn->unique_id_, status);
+}
+
+void TxnProcessor::RestartTxn(Txn* txn) {
+  SetStatus(txn, ABORTED);
+
+  // No version names the txn any more, and readers only look it up by id.
+  storage_->txn_status_.Release(txn->unique_id_);
+  LeaveActiveSlot();
 
+  double delay;
+  if (!contention_->Retry(txn->retries_, &delay)) {
+    // Out of retries: the client gets the txn back ABORTED.
+    EmptyReadWrites(txn);
+    DeliverResult(txn);
+    return;
   }
 
-  for (map<Key, Version*>::iterator it = txn->writes_[SAVINGS].begin();
-     it != txn->writes_[SAVINGS].end(); ++it) {
+  // The next attempt takes a new id, so the txn object itself can be reused.
+  txn->Restart();
+  txn->retries_++;
+  QueueRetry(txn, delay);
+}
+
+void TxnProcessor::QueueRetry(Txn* txn, double delay) {
+  retry_mutex_.Lock();
+  retry_queue_.push(std::make_pair(GetTime() + delay, txn));
+  pending_retries_++;
+  next_retry_ = retry_queue_.top().first;
+  retry_mutex_.Unlock();
+
+  // A sleeping worker needs to know to wake up in time for it.
+  if (dispatch_ == DISPATCH_DIRECT) {
+    WakeWorkers(1);
+  }
+}
 
-    // first is the old version, 2nd is new version
-    storage_->PutEndTimestamp(txn->reads_[SAVINGS][it->first], txn->writes_[SAVINGS][it->first], txn->end_unique_id_);
+bool TxnProcessor::PopRetry(Txn** txn) {
+  if (pending_retries_.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  double now = GetTime();
+  if (next_retry_.load() > now) {
+    return false;
+  }
 
+  retry_mutex_.Lock();
+  bool found = !retry_queue_.empty() && retry_queue_.top().first <= now;
+  if (found) {
+    *txn = retry_queue_.top().second;
+    retry_queue_.pop();
+    pending_retries_--;
   }
+  next_retry_ = retry_queue_.empty() ? std::numeric_limits<double>::max()
+                                     : retry_queue_.top().first;
+  retry_mutex_.Unlock();
+  return found;
+}
 
+void TxnProcessor::FinishTxn(Txn* txn) {
+  storage_->txn_status_.Release(txn->unique_id_);
+  LeaveActiveSlot();
+  DeliverResult(txn);
 }
 
-void TxnProcessor::EmptyReadWrites(Txn* txn) {
-  txn->reads_[CHECKING].clear();
-  txn->writes_[CHECKING].clear();
-  txn->vals_[CHECKING].clear();
-  txn->reads_[SAVINGS].clear();
-  txn->writes_[SAVINGS].clear();
-  txn->vals_[SAVINGS].clear();
+void TxnProcessor::DeliverResult(Txn* txn) {
+  txn->finish_time_ = GetTime();
+  if (txn->callback_ != NULL) {
+    txn->callback_->Done(txn);
+  } else {
+    txn_results_.Push(txn);
+    if (result_waiters_.load() > 0) {
+      results_seq_++;
+      FutexWake(&results_seq_, 1);
+    }
+  }
+  in_flight_--;
+}
+
+void TxnProcessor::ReadOnlyExecuteTxn(Txn* txn) {
+  // Publish a lower bound of the snapshot before taking it, so LowWatermark()
+  // cannot miss us and GC keeps the versions we are about to read.
+  ActiveTxnSlot* slot = ActiveSlot();
+  slot->start_id_ = CurrentTimestamp() - 1;
+
+  // Writers that end after the snapshot stay invisible. Under SI a writer is
+  // COMMITTING once it has an end timestamp, and reads wait that out. A CSI
+  // writer validates after taking its end timestamp while still ACTIVE, so
+  // its versions are skipped as uncommitted even if it goes on to commit
+  // with an end timestamp below the snapshot; CSI validation reads share
+  // this window.
+  uint64 snapshot = CurrentTimestamp() - 1;
+  slot->start_id_ = snapshot;
+  txn->unique_id_ = snapshot;
+  txn->end_unique_id_ = snapshot;
+  txn->status_ = ACTIVE;
+
+  for (size_t tbl = 0; tbl < txn->readset_.size(); ++tbl) {
+    for (KeySet::iterator it = txn->readset_[tbl].begin();
+       it != txn->readset_[tbl].end(); ++it) {
+      Version * result = NULL;
+      if (storage_->ReadSnapshot(*it, &result, snapshot, static_cast<TableType>(tbl))) {
+        txn->reads_[tbl][*it] = result;
+      }
+    }
+  }
 
+  txn->Run();
+  if (txn->Status() != ABORTED) {
+    txn->status_ = COMMITTED;
+  }
+
+  // Never entered in the status table, so there is nothing to release.
+  LeaveActiveSlot();
+  DeliverResult(txn);
 }
 
 void TxnProcessor::CSIExecuteTxn(Txn* txn) {
+  if (txn->read_only_) {
+    ReadOnlyExecuteTxn(txn);
+    return;
+  }
+
   // Begin stage
   GetBeginTimestamp(txn);
+  txn->doom_word_ = storage_->txn_status_.DoomWord(txn->unique_id_);
+  txn->storage_ = storage_;
 
   // Normal execution stage
   // For all transactions that reach end of version deque
   // and do not get valid version to read, abort it
   // OR if
   if (!GetReads(txn) || !CheckWrites(txn)) {
-    EmptyReadWrites(txn);
-    Txn* copy = txn->clone();
-    copy->status_ = INCOMPLETE;
-    txn->status_ = ABORTED;
-
-    // Copy txn
-    txn_requests_.Push(copy);
+    ReleaseWrites(txn);
+    RestartTxn(txn);
     return;
   }
 
 
   txn->Run();
-  // txn->writes_[CHECKING].empty();
-  // txn->writes_[SAVINGS].empty();
+
+  // Another writer changed the outcome of a predicate the txn checked; don't
+  // bother validating.
+  if (txn->Doomed()) {
+    ReleaseWrites(txn);
+    FreeWrites(txn);
+    RestartTxn(txn);
+    return;
+  }
 
   // If it's aborted here, it is a permanent abort
   if (txn->Status() == ABORTED) {
+    SetStatus(txn, ABORTED);
+    ReleaseWrites(txn);
+    FreeWrites(txn);
     EmptyReadWrites(txn);
-    txn_results_.Push(txn);
+    FinishTxn(txn);
     return;
   }
 
@@ -418,37 +783,34 @@ void TxnProcessor::CSIExecuteTxn(Txn* txn) {
   GetValidationReads(txn);
 
   if (txn->Validate()) {
-    txn->status_ = COMMITTED;
+    SetStatus(txn, COMMITTED);
   }
   else {
-    EmptyReadWrites(txn);
-    Txn* copy = txn->clone();
-    copy->status_ = INCOMPLETE;
-    txn->status_ = ABORTED;
-
-    // Copy txn
-    txn_requests_.Push(copy);
+    // Our new versions are already installed; this makes them invisible.
+    ReleaseWrites(txn);
+    RestartTxn(txn);
     return;
   }
 
   // Postprocessing Phase
   if (txn->Status() == COMMITTED){
     PutEndTimestamps(txn);
-    txn_results_.Push(txn);
+    SettleWrites(txn);
+    FinishTxn(txn);
   }
 }
 
 void TxnProcessor::SnapshotExecuteTxn(Txn* txn) {
+  if (txn->read_only_) {
+    ReadOnlyExecuteTxn(txn);
+    return;
+  }
 
   GetBeginTimestamp(txn);
 
   if (!GetReads(txn) || !CheckWrites(txn)) {
-    EmptyReadWrites(txn);
-    Txn* copy = txn->clone();
-    copy->status_ = INCOMPLETE;
-    txn->status_ = ABORTED;
-    // Copy txn
-    txn_requests_.Push(copy);
+    ReleaseWrites(txn);
+    RestartTxn(txn);
     return;
   }
 
@@ -462,40 +824,107 @@ void TxnProcessor::SnapshotExecuteTxn(Txn* txn) {
     // If it's aborted here, it is a permanent abort
     else {
 
+      SetStatus(txn, ABORTED);
+      ReleaseWrites(txn);
+      FreeWrites(txn);
       EmptyReadWrites(txn);
-      txn_results_.Push(txn);
+      FinishTxn(txn);
+      return;
 
     }
   }
 
   if (txn->Status() == COMMITTED){
     PutEndTimestamps(txn);
-    txn_results_.Push(txn);
+    SettleWrites(txn);
+    FinishTxn(txn);
   }
 }
 
 void TxnProcessor::RunSnapshotScheduler() {
   Txn* txn;
-  while (tp_.Active()) {
-    if (txn_requests_.Pop(&txn)) {
-      tp_.RunTask(new Method<TxnProcessor, void, Txn*>(
-            this,
-            &TxnProcessor::SnapshotExecuteTxn,
-            txn));
+  while (!stopped_) {
+    if (PopRetry(&txn) || txn_requests_.Pop(&txn)) {
+      txn->dispatch_task_.Set(this, &TxnProcessor::SnapshotExecuteTxn, txn);
+      tp_.RunTask(&txn->dispatch_task_);
     }
   }
 }
 
 void TxnProcessor::RunCSIScheduler() {
   Txn* txn;
-  while (tp_.Active()) {
-    if (txn_requests_.Pop(&txn)) {
-      tp_.RunTask(new Method<TxnProcessor, void, Txn*>(
-            this,
-            &TxnProcessor::CSIExecuteTxn,
-            txn));
+  while (!stopped_) {
+    if (PopRetry(&txn) || txn_requests_.Pop(&txn)) {
+      txn->dispatch_task_.Set(this, &TxnProcessor::CSIExecuteTxn, txn);
+      tp_.RunTask(&txn->dispatch_task_);
     }
   }
 }
 
 /////////////////////// END OF SI AND CSI EXECUTION /////////////////////////////
+
+/////////////////////////// GARBAGE COLLECTION /////////////////////////////////
+
+ActiveTxnSlot* TxnProcessor::ActiveSlot() {
+  // The slot is cached per thread along with the processor it belongs to, so
+  // a thread that runs txns for another processor takes a slot there too.
+  static thread_local TxnProcessor* owner = NULL;
+  static thread_local int slot = -1;
+  if (owner != this) {
+    slot = next_active_slot_++;
+    DCHECK(slot < tp_.ThreadCount());
+    owner = this;
+  }
+  return &active_[slot];
+}
+
+void TxnProcessor::LeaveActiveSlot() {
+  ActiveSlot()->start_id_ = 0;
+}
+
+uint64 TxnProcessor::CurrentTimestamp() {
+  return next_unique_id_.load();
+}
+
+uint64 TxnProcessor::LowWatermark() {
+  // Read the clock first: a txn that got its start timestamp before this
+  // point has already published it, or at least a lower bound of it (see
+  // GetBeginTimestamp). Read-only txns that start later may read one below
+  // the clock (see ReadOnlyExecuteTxn).
+  uint64 low_watermark = CurrentTimestamp() - 1;
+  for (int i = 0; i < tp_.ThreadCount(); i++) {
+    uint64 start_id = active_[i].start_id_;
+    if (start_id != 0 && start_id < low_watermark) {
+      low_watermark = start_id;
+    }
+  }
+  return low_watermark;
+}
+
+void TxnProcessor::GarbageCollection() {
+  uint64 low_watermark = LowWatermark();
+
+  // Everything retired at or before the low watermark is unreachable: the
+  // txns that could still see it have all finished.
+  while (!version_limbo_.empty() && version_limbo_.front().first <= low_watermark) {
+    VersionRun run = version_limbo_.front().second;
+    VersionChain::FreeVersions(run.first, run.second);
+    version_limbo_.pop_front();
+  }
+
+  // Unlink versions no running txn can read. Txns that are running now may
+  // still be traversing them, so they are freed in a later pass.
+  vector<VersionRun> garbage;
+  storage_->CollectGarbage(low_watermark, &garbage);
+  uint64 retired_at = CurrentTimestamp();
+  for (vector<VersionRun>::iterator it = garbage.begin(); it != garbage.end(); ++it) {
+    version_limbo_.push_back(std::make_pair(retired_at, *it));
+  }
+}
+
+void TxnProcessor::RunGarbageCollector() {
+  while (!gc_stopped_) {
+    GarbageCollection();
+    Sleep(GC_INTERVAL);
+  }
+}
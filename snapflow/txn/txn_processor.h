@@ -5,22 +5,33 @@
 #ifndef _TXN_PROCESSOR_H_
 #define _TXN_PROCESSOR_H_
 
+#include <atomic>
 #include <deque>
+#include <functional>
 #include <map>
+#include <queue>
 #include <string>
+#include <utility>
 
+#include "txn/catalog.h"
 #include "txn/common.h"
+#include "txn/contention_manager.h"
 #include "txn/mvcc_storage.h"
 #include "txn/lock_mvcc_storage.h"
 #include "txn/txn.h"
 #include "utils/atomic.h"
-#include "utils/static_thread_pool.h"
+#include "utils/cpu_topology.h"
+#include "utils/futex.h"
+#include "utils/lockfree_queue.h"
+#include "utils/work_stealing_thread_pool.h"
 #include "utils/mutex.h"
 #include "utils/condition.h"
 
 
 using std::deque;
 using std::map;
+using std::pair;
+using std::priority_queue;
 using std::string;
 
 enum CCMode {
@@ -30,29 +41,116 @@ enum CCMode {
 };
 
 
+// Start timestamp of the txn a worker thread is currently executing (0 while
+// the worker is idle), padded so that every worker writes its own cache line.
+struct ActiveTxnSlot {
+  std::atomic<uint64> start_id_;
+  char padding_[64 - sizeof(std::atomic<uint64>)];
+};
+
+// How txn requests reach the worker threads.
+enum DispatchMode {
+  // A scheduler thread pops every request off one queue and hands it to the
+  // thread pool as a task.
+  DISPATCH_SCHEDULER,
+
+  // Requests are spread over per-worker queues, and each worker runs a loop
+  // pulling from its own queue first and from the others when it is empty.
+  // There is no scheduler thread.
+  DISPATCH_DIRECT,
+};
+
+// How many worker threads a TxnProcessor runs and where its threads go. The
+// default uses every CPU the process may run on, core by core, with workers
+// pulling requests directly.
+struct ProcessorConfig {
+  ProcessorConfig()
+      : workers_(0), pinning_(PIN_COMPACT), numa_node_(0),
+        scheduler_(COORDINATOR_DEDICATED), dispatch_(DISPATCH_DIRECT),
+        contention_manager_(NULL) {}
+
+  // Number of worker threads. 0 means one per CPU that 'pinning_' allows,
+  // less the scheduler's if it has a dedicated one.
+  int workers_;
+
+  // Pinning policy for the workers, and the NUMA node used by PIN_NUMA_NODE.
+  PinPolicy pinning_;
+  int numa_node_;
+
+  // Placement of the scheduler thread relative to the workers. Ignored with
+  // DISPATCH_DIRECT.
+  CoordinatorPlacement scheduler_;
+
+  DispatchMode dispatch_;
+
+  // Policy for retrying txns that abort on a conflict. Not owned; must
+  // outlive the TxnProcessor. NULL means a default BackoffManager.
+  ContentionManager* contention_manager_;
+};
+
 class TxnProcessor {
  public:
-  // The TxnProcessor's constructor starts the TxnProcessor running in the
-  // background.
-  explicit TxnProcessor(CCMode mode);
-
-  // The TxnProcessor's destructor stops all background threads and deallocates
-  // all objects currently owned by the TxnProcessor, except for Txn objects.
+  // The TxnProcessor's constructor creates and loads a table for every entry
+  // of 'catalog', then starts the TxnProcessor running in the background
+  // with threads laid out as per 'config'.
+  explicit TxnProcessor(CCMode mode,
+                        const Catalog& catalog = Catalog::Default(),
+                        const ProcessorConfig& config = ProcessorConfig());
+
+  // The TxnProcessor's destructor stops all background threads (see Stop())
+  // and deallocates all objects currently owned by the TxnProcessor, except
+  // for Txn objects.
   ~TxnProcessor();
 
+  // Stops admitting txns, then waits up to 'timeout' seconds (as long as it
+  // takes if 'timeout' is not positive) for every txn admitted so far to
+  // commit or abort for good and be handed back. Returns whether all of them
+  // were. From then on, new requests are handed back ABORTED without
+  // running, on the submitting thread.
+  bool Quiesce(double timeout = 0);
+
+  // Stops the worker loops or the scheduler, lets txns that are already
+  // executing finish, and joins every background thread. Txns still queued
+  // are never run; Quiesce() first to avoid that. Safe to call more than
+  // once. Takes about as long as the longest txn that is executing.
+  void Stop();
+
   // Registers a new txn request to be executed by the TxnProcessor.
-  // Ownership of '*txn' is transfered to the TxnProcessor.
-  void NewTxnRequest(Txn* txn);
+  // Ownership of '*txn' is transfered to the TxnProcessor. If 'callback' is
+  // not NULL, the finished txn is passed to callback->Done() instead of being
+  // returned by GetTxnResult(). 'callback' must outlive the txn.
+  // Requires: txn only touches tables registered in the catalog.
+  void NewTxnRequest(Txn* txn, TxnCallback* callback = NULL);
+
+  // Same as calling NewTxnRequest() on txns[0..count-1], but queues them
+  // with one synchronization per request queue rather than one per txn.
+  void NewTxnRequests(Txn* const* txns, int count,
+                      TxnCallback* callback = NULL);
 
   // Returns a pointer to the next COMMITTED or ABORTED Txn. The caller takes
-  // ownership of the returned Txn.
+  // ownership of the returned Txn. Polls for a while (adapting how long to
+  // how quickly results have been arriving) and then sleeps until a result
+  // is queued.
   Txn* GetTxnResult();
 
-  // Main loop implementing all concurrency control/thread scheduling.
+  // Moves up to 'max' COMMITTED or ABORTED txns into 'txns' and returns how
+  // many it moved; the caller takes ownership of them. Waits for the first
+  // one like GetTxnResult(), but for at most 'timeout' seconds (0 means do
+  // not wait, a negative value means wait as long as it takes). Returns 0 if
+  // none arrived in time.
+  int GetTxnResults(Txn** txns, int max, double timeout = -1);
+
+  // Returns how many seconds it took to load the initial storage.
+  double LoadTime() { return load_time_; }
+
+  // Main loop implementing all concurrency control/thread scheduling, for
+  // DISPATCH_SCHEDULER.
   void RunScheduler();
 
   static void* StartScheduler(void * arg);
 
+  static void* StartGarbageCollector(void * arg);
+
   // An instance transaction table of txns that have WRITTEN/TRIED TO WRITE
   // to the database
 
@@ -90,6 +188,10 @@ class TxnProcessor {
 
   void GetBeginTimestamp(Txn* txn);
 
+  // Assigns the txn its end timestamp. Unless 'val' is set the txn commits
+  // at that timestamp: it is COMMITTING from just before the timestamp is
+  // taken until it is COMMITTED, so no reader that starts after the commit
+  // timestamp can see it as ACTIVE.
   void GetEndTimestamp(Txn* txn, const bool& val = true);
 
   bool GetReads(Txn* txn);
@@ -104,42 +206,192 @@ class TxnProcessor {
 
   void EmptyReadWrites(Txn* txn);
 
+  // Detaches an aborting txn from every version it claimed or installed.
+  void ReleaseWrites(Txn* txn);
+
+  // Stamps a committed txn's end timestamp over anything in storage that
+  // still names it, so that its status table entry can be released.
+  void SettleWrites(Txn* txn);
+
+  // Frees the versions a txn wrote but never installed in storage.
+  void FreeWrites(Txn* txn);
+
+  // Sets a txn's status, both on the txn and in storage's status table.
+  void SetStatus(Txn* txn, TxnStatus status);
+
+  // Resets a txn that aborted on a conflict (see Txn::Restart()) and
+  // resubmits it after the delay the contention manager asks for. If the
+  // contention manager gives up on it, hands it back ABORTED instead.
+  void RestartTxn(Txn* txn);
+
+  // Hands a COMMITTED or permanently ABORTED txn back to the client.
+  void FinishTxn(Txn* txn);
+
+  // Counts 'count' new requests as in flight. Returns false, after handing
+  // them back ABORTED, if Quiesce() has been called.
+  bool Admit(Txn* const* txns, int count);
+
+  // The part of FinishTxn() that passes the txn to its callback or queues it
+  // for GetTxnResult().
+  void DeliverResult(Txn* txn);
+
+  // Holds a restarted txn back for 'delay' seconds.
+  void QueueRetry(Txn* txn, double delay);
+
+  // Pops a restarted txn whose delay is over. Returns false if there is none.
+  bool PopRetry(Txn** txn);
+
+  // Executes 'txn' on the calling worker thread under 'mode_'.
+  void RunTxn(Txn* txn);
+
+  // Queues a request for the workers (DISPATCH_DIRECT). Requests queued by a
+  // worker, i.e. restarts, go to that worker's own queue.
+  void QueueRequest(Txn* txn);
+
+  // Wakes up to 'count' workers sleeping in RunWorker().
+  void WakeWorkers(int count);
+
+  // Worker loop for DISPATCH_DIRECT: runs requests from queue 'shard' (and
+  // the others when it is empty) until the processor stops.
+  void RunWorker(int shard);
+
+  // Pops a request off queue 'shard', or off any other queue if that one is
+  // empty. Returns false if all are empty.
+  bool PopRequest(int shard, Txn** txn);
+
   // snapshot version of scheduler.
   void RunSnapshotScheduler();
 
   // run our new version
   void RunCSIScheduler();
 
+  // One garbage collection pass: frees versions unlinked before every
+  // running txn started, then unlinks versions that have become unreadable.
   void GarbageCollection();
 
+  // Background loop running GarbageCollection() until the processor stops.
+  void RunGarbageCollector();
+
+  // Returns the next unique id to be handed out. Every txn that has a start
+  // timestamp at this point has one below the returned value.
+  uint64 CurrentTimestamp();
+
+  // Returns a timestamp no greater than the start timestamp of any running
+  // txn (or CurrentTimestamp() if none is running).
+  uint64 LowWatermark();
+
+  // Returns this worker thread's slot in 'active_'.
+  ActiveTxnSlot* ActiveSlot();
+
+  // Marks the calling worker as no longer running a txn.
+  void LeaveActiveSlot();
+
   void SnapshotExecuteTxn(Txn* txn);
 
+  // SI and CSI execution of a txn that declared itself read-only. It reads at
+  // the newest timestamp handed out so far without taking one of its own,
+  // and commits without validation. The only shared state it writes is the
+  // worker's own ActiveTxnSlot.
+  void ReadOnlyExecuteTxn(Txn* txn);
+
   void CSIExecuteTxn(Txn* txn);
 
   // Concurrency control mechanism the TxnProcessor is currently using.
   CCMode mode_;
 
+  // Tables held by 'storage_'.
+  Catalog catalog_;
+
+  // CPUs of the worker and scheduler threads.
+  ThreadPlacement placement_;
+
   // Thread pool managing all threads used by TxnProcessor.
-  StaticThreadPool tp_;
+  WorkStealingThreadPool tp_;
 
   // Data storage used for all modes.
   MVCCStorage* storage_;
 
-  // Next valid unique_id, and a mutex to guard incoming txn requests.
-  int next_unique_id_ = 1;
-  Mutex mutex_;
+  // Seconds spent loading 'storage_'.
+  double load_time_;
+
+  // Timestamp oracle: the next valid unique_id. Begin and end timestamps are
+  // both taken from it with a single fetch-add. Starts at 2, so that the
+  // snapshot of a read-only txn (the last timestamp handed out) is never 0,
+  // which marks an idle ActiveTxnSlot.
+  std::atomic<uint64> next_unique_id_;
+
+  // Queue of incoming transaction requests (DISPATCH_SCHEDULER).
+  SegmentedQueue<Txn*> txn_requests_;
+
+  // DISPATCH_DIRECT: one request queue per worker, and the round-robin
+  // cursor used to spread new requests over them.
+  DispatchMode dispatch_;
+  SegmentedQueue<Txn*>* request_shards_;
+  std::atomic<unsigned int> next_shard_;
+
+  // Scheduler thread (DISPATCH_SCHEDULER).
+  pthread_t scheduler_thread_;
+
+  // Cleared by Quiesce(), after which requests are turned away, and the
+  // number of txns submitted but not yet handed back.
+  std::atomic<bool> admitting_;
+  std::atomic<int> in_flight_;
+
+  // Set by Stop() to end the worker loops or the scheduler.
+  std::atomic<bool> stopped_;
+
+  // Decides how aborted txns are retried, and whether we own it.
+  ContentionManager* contention_;
+  bool owns_contention_;
+
+  // Restarted txns waiting out their delay, earliest due first. Workers (or
+  // the scheduler) take due ones ahead of new requests. Only touched on
+  // aborts, so a mutex is fine; 'pending_retries_' and 'next_retry_' (the
+  // earliest due time) let everyone else skip it without locking.
+  Mutex retry_mutex_;
+  priority_queue<pair<double, Txn*>, vector<pair<double, Txn*> >,
+                 std::greater<pair<double, Txn*> > > retry_queue_;
+  std::atomic<int> pending_retries_;
+  std::atomic<double> next_retry_;
 
-  // Queue of incoming transaction requests.
-  AtomicQueue<Txn*> txn_requests_;
+  // Futex word bumped when a request is queued while a worker sleeps in
+  // RunWorker(), and the number of such workers.
+  std::atomic<int> requests_seq_;
+  std::atomic<int> request_waiters_;
 
 
   // THESE SEEM Deprecated, but I think we might want to implement
   // Queue of completed (but not yet committed/aborted) transactions.
-  AtomicQueue<Txn*> completed_txns_;
+  SegmentedQueue<Txn*> completed_txns_;
 
   // Queue of transaction results (already committed or aborted) to be returned
   // to client.
-  AtomicQueue<Txn*> txn_results_;
+  SegmentedQueue<Txn*> txn_results_;
+
+  // Futex word bumped when a result is queued while a client sleeps in
+  // GetTxnResult(), and the number of such clients.
+  std::atomic<int> results_seq_;
+  std::atomic<int> result_waiters_;
+
+  // How many times GetTxnResult() polls 'txn_results_' before sleeping, and
+  // the most it ever polls (0 on machines with one core, where polling only
+  // takes time away from the workers).
+  std::atomic<int> result_spin_;
+  int result_spin_max_;
+
+  // One slot per worker thread, published when a txn takes its start
+  // timestamp and cleared when it finishes. The minimum is the low watermark
+  // used by garbage collection.
+  ActiveTxnSlot* active_;
+  std::atomic<int> next_active_slot_;
+
+  // Garbage collector thread.
+  pthread_t gc_thread_;
+  std::atomic<bool> gc_stopped_;
+
+  // Unlinked versions waiting for the low watermark to pass their tag. Only
+  // touched by the garbage collector thread.
+  deque<pair<uint64, VersionRun> > version_limbo_;
 };
 
 #endif  // _TXN_PROCESSOR_H_
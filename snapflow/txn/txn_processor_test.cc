@@ -128,6 +128,10 @@ class RMWLoadGen2 : public LoadGen {
   double wait_time_;
 };
 
+// Thread layout of every TxnProcessor the benchmark creates. Set up by main()
+// so that the client thread has a CPU to itself.
+ProcessorConfig processor_config;
+
 void Benchmark(const vector<LoadGen*>& lg) {
   // Number of transaction requests that can be active at any given time.
   int active_txns = 100;
@@ -140,6 +144,18 @@ void Benchmark(const vector<LoadGen*>& lg) {
     // Print out mode name.
     cout << ModeToString(mode) << flush;
 
+    // Total time spent loading storage across all rounds of this mode.
+    double load_time = 0;
+    int loads = 0;
+
+    // Total time between a result being handed back and GetTxnResult()
+    // returning it, across all results of this mode.
+    double result_latency = 0;
+    long results = 0;
+
+    // Total number of conflict restarts of those results.
+    long retries = 0;
+
     // For each experiment, run 3 times and get the average.
     for (uint32 exp = 0; exp < lg.size(); exp++) {
       double throughput[3];
@@ -148,28 +164,48 @@ void Benchmark(const vector<LoadGen*>& lg) {
         int txn_count = 0;
 
         // Create TxnProcessor in next mode.
-        TxnProcessor* p = new TxnProcessor(mode);
+        TxnProcessor* p =
+            new TxnProcessor(mode, Catalog::Default(), processor_config);
+        load_time += p->LoadTime();
+        loads++;
 
         // Record start time.
         double start = GetTime();
 
         // Start specified number of txns running.
+        vector<Txn*> batch(active_txns);
         for (int i = 0; i < active_txns; i++)
-          p->NewTxnRequest(lg[exp]->NewTxn());
+          batch[i] = lg[exp]->NewTxn();
+        p->NewTxnRequests(&batch[0], active_txns);
 
-        // Keep 100 active txns at all times for the first full second.
+        // Keep 100 active txns at all times for the first full second,
+        // replacing every batch of results with as many new txns.
         while (GetTime() < start + 1) {
-          Txn* txn = p->GetTxnResult();
-          doneTxns.push_back(txn);
-          txn_count++;
-          p->NewTxnRequest(lg[exp]->NewTxn());
+          int n = p->GetTxnResults(&batch[0], active_txns);
+          for (int i = 0; i < n; i++) {
+            Txn* txn = batch[i];
+            result_latency += GetTime() - txn->FinishTime();
+            results++;
+            retries += txn->Retries();
+            doneTxns.push_back(txn);
+            txn_count++;
+            batch[i] = lg[exp]->NewTxn();
+          }
+          p->NewTxnRequests(&batch[0], n);
         }
 
         // Wait for all of them to finish.
-        for (int i = 0; i < active_txns; i++) {
-          Txn* txn = p->GetTxnResult();
-          doneTxns.push_back(txn);
-          txn_count++;
+        for (int left = active_txns; left > 0;) {
+          int n = p->GetTxnResults(&batch[0], left);
+          for (int i = 0; i < n; i++) {
+            Txn* txn = batch[i];
+            result_latency += GetTime() - txn->FinishTime();
+            results++;
+            retries += txn->Retries();
+            doneTxns.push_back(txn);
+            txn_count++;
+          }
+          left -= n;
         }
 
         // Record end time.
@@ -185,6 +221,15 @@ void Benchmark(const vector<LoadGen*>& lg) {
       cout << "\t" << (throughput[0] + throughput[1] + throughput[2]) / 3 << "\t" << flush;
     }
 
+    // Print average storage load time
+    cout << "\t(load " << load_time / loads << "s)";
+
+    // Print average result pickup latency
+    cout << "\t(result " << result_latency / results * 1e6 << "us)";
+
+    // Print average restarts per txn
+    cout << "\t(retries " << static_cast<double>(retries) / results << ")";
+
     cout << endl;
   }
 }
@@ -194,9 +239,15 @@ int main(int argc, char** argv) {
   cout << "\t\t0.1ms\t\t1ms\t\t10ms";
   cout << endl;
 
+  // Workers fill the CPUs core by core, leaving the last one to this (client)
+  // thread.
+  CpuTopology topology = CpuTopology::Detect();
+  vector<int> cpus = topology.Order(PIN_COMPACT);
+  processor_config.workers_ = std::max(1, topology.CpuCount() - 1);
+
   cpu_set_t cs;
   CPU_ZERO(&cs);
-  CPU_SET(7, &cs);
+  CPU_SET(cpus.back(), &cs);
   int ret = sched_setaffinity(0, sizeof(cs), &cs);
   if (ret) {
     perror("sched_setaffinity");
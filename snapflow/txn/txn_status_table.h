@@ -0,0 +1,118 @@
+// Status of in-flight txns, as seen by the version visibility checks.
+
+#ifndef _TXN_STATUS_TABLE_H_
+#define _TXN_STATUS_TABLE_H_
+
+#include <atomic>
+
+#include "txn/common.h"
+#include "txn/txn.h"
+
+// Number of entries in a TxnStatusTable. Must be a power of two.
+#define TXN_STATUS_TABLE_SIZE (1 << 16)
+
+// Ring buffer holding the status and end timestamp of every running txn,
+// indexed by txn id (its start timestamp). A Timestamp word that names a
+// writer names it by id, and MVCCStorage resolves it here with a couple of
+// plain loads instead of going through the Txn object, so a Txn can be freed
+// as soon as it leaves the TxnProcessor.
+//
+// A txn claims its entry when it takes its start timestamp and releases it
+// once no version names it any more, i.e. after it has stamped its versions
+// with its end timestamp or detached from them on abort. A txn whose entry is
+// still held by the txn TXN_STATUS_TABLE_SIZE ids before it waits for it.
+class TxnStatusTable {
+ public:
+  TxnStatusTable() : entries_(new Entry[TXN_STATUS_TABLE_SIZE]) {
+    for (int i = 0; i < TXN_STATUS_TABLE_SIZE; i++) {
+      entries_[i].state_ = 0;
+      entries_[i].end_id_ = INF_INT;
+      entries_[i].doomed_ = 0;
+    }
+  }
+
+  ~TxnStatusTable() { delete[] entries_; }
+
+  // Claims the entry of txn 'id' and marks it ACTIVE.
+  void Begin(uint64 id) {
+    Entry& entry = At(id);
+    while (entry.state_.load(std::memory_order_acquire) != 0) {
+      Sleep(0.000001);
+    }
+    entry.end_id_.store(INF_INT, std::memory_order_relaxed);
+    entry.state_.store(State(id, ACTIVE), std::memory_order_release);
+  }
+
+  // Requires: txn 'id' holds its entry.
+  void SetStatus(uint64 id, TxnStatus status) {
+    At(id).state_.store(State(id, status), std::memory_order_release);
+  }
+
+  // Requires: txn 'id' holds its entry. Call before setting a status that
+  // readers use to pick up the end timestamp.
+  void SetEndID(uint64 id, uint64 end_id) {
+    At(id).end_id_.store(end_id, std::memory_order_release);
+  }
+
+  // Dooms txn 'id' (see Txn::Doomed()) if it is still ACTIVE. If the txn
+  // has just finished, the entry may have passed to a newer txn, which is
+  // left alone since the id does not match.
+  void Doom(uint64 id) {
+    Entry& entry = At(id);
+    if (entry.state_.load(std::memory_order_acquire) == State(id, ACTIVE)) {
+      entry.doomed_.store(id, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns the word Doom(id) sets to 'id'. Requires: txn 'id' holds its
+  // entry.
+  std::atomic<uint64>* DoomWord(uint64 id) { return &At(id).doomed_; }
+
+  // Frees the entry of txn 'id'. Requires: no version names 'id' any more.
+  void Release(uint64 id) {
+    At(id).state_.store(0, std::memory_order_release);
+  }
+
+  // Reads the status and end timestamp of txn 'id'. Returns false if 'id' no
+  // longer holds its entry, in which case the Timestamp word that named it
+  // has changed since it was loaded and should be loaded again.
+  bool Lookup(uint64 id, TxnStatus* status, uint64* end_id) const {
+    const Entry& entry = At(id);
+    uint64 state = entry.state_.load(std::memory_order_acquire);
+    if ((state >> STATUS_BITS) != id) {
+      return false;
+    }
+    *end_id = entry.end_id_.load(std::memory_order_acquire);
+    // The entry may have been handed to another txn after we read the state.
+    if (entry.state_.load(std::memory_order_acquire) >> STATUS_BITS != id) {
+      return false;
+    }
+    *status = static_cast<TxnStatus>(state & ((1 << STATUS_BITS) - 1));
+    return true;
+  }
+
+ private:
+  // Low bits of an entry's state that hold the TxnStatus.
+  static const int STATUS_BITS = 4;
+
+  // The owning txn's id and its status share one word, so that they are
+  // always read together. A free entry has state 0 (txn ids start at 1).
+  struct Entry {
+    std::atomic<uint64> state_;
+    std::atomic<uint64> end_id_;
+    // Id of the txn last doomed through this entry.
+    std::atomic<uint64> doomed_;
+  };
+
+  static uint64 State(uint64 id, TxnStatus status) {
+    return (id << STATUS_BITS) | status;
+  }
+
+  Entry& At(uint64 id) const {
+    return entries_[id & (TXN_STATUS_TABLE_SIZE - 1)];
+  }
+
+  Entry* entries_;
+};
+
+#endif  // _TXN_STATUS_TABLE_H_
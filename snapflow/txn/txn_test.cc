@@ -0,0 +1,57 @@
+// Checks evaluation of the predicates txns record with Txn::Check().
+
+#include "txn/txn.h"
+
+#include "utils/testing.h"
+
+TEST(PredicateComparisonTest) {
+  Value five = 5;
+  Value six = 6;
+  EXPECT_TRUE(Predicate(CMP_EQ, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_FALSE(Predicate(CMP_EQ, 5).Plus(CHECKING, 1).Evaluate(&six));
+  EXPECT_TRUE(Predicate(CMP_NE, 5).Plus(CHECKING, 1).Evaluate(&six));
+  EXPECT_FALSE(Predicate(CMP_NE, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_TRUE(Predicate(CMP_LT, 6).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_FALSE(Predicate(CMP_LT, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_TRUE(Predicate(CMP_LE, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_FALSE(Predicate(CMP_LE, 5).Plus(CHECKING, 1).Evaluate(&six));
+  EXPECT_TRUE(Predicate(CMP_GT, 5).Plus(CHECKING, 1).Evaluate(&six));
+  EXPECT_FALSE(Predicate(CMP_GT, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_TRUE(Predicate(CMP_GE, 5).Plus(CHECKING, 1).Evaluate(&five));
+  EXPECT_FALSE(Predicate(CMP_GE, 6).Plus(CHECKING, 1).Evaluate(&five));
+
+  // The empty predicate holds.
+  EXPECT_TRUE(Predicate().Evaluate(NULL));
+  EXPECT_EQ(0, Predicate().TermCount());
+
+  END;
+}
+
+TEST(PredicateMultiTermTest) {
+  // 2 * a - b + c <= 10, over records in both tables.
+  Predicate p = Predicate(CMP_LE, 10).Plus(CHECKING, 1, 2)
+                                     .Plus(SAVINGS, 1, -1)
+                                     .Plus(CHECKING, 7);
+  EXPECT_EQ(3, p.TermCount());
+  EXPECT_EQ(SAVINGS, p.GetTerm(1).table_);
+  EXPECT_EQ(7, static_cast<int>(p.GetTerm(2).key_));
+  EXPECT_EQ(-1, static_cast<int>(p.GetTerm(1).coefficient_));
+
+  Value holds[] = {4, 3, 5};       // 8 - 3 + 5 = 10
+  Value violated[] = {4, 2, 5};    // 8 - 2 + 5 = 11
+  EXPECT_TRUE(p.Evaluate(holds));
+  EXPECT_FALSE(p.Evaluate(violated));
+
+  // Values count as signed, so an overdrawn balance is negative.
+  Value overdrawn[] = {static_cast<Value>(-2), 3};
+  EXPECT_FALSE(Predicate(CMP_GE, 0).Plus(CHECKING, 1).Evaluate(overdrawn));
+  EXPECT_TRUE(Predicate(CMP_GE, 1).Plus(CHECKING, 1).Plus(SAVINGS, 1)
+                  .Evaluate(overdrawn));
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  PredicateComparisonTest();
+  PredicateMultiTermTest();
+}
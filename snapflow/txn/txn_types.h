@@ -8,6 +8,7 @@
 #include <set>
 #include <string>
 
+#include "txn/catalog.h"
 #include "txn/txn.h"
 
 // Immediately commits.
@@ -23,75 +24,74 @@ class Noop : public Txn {
   }
 };
 
-// Reads all keys in the map 'm', if all results correspond to the values in
-// the provided map, commits, else aborts.
-// class Expect : public Txn {
-//  public:
-//   Expect(const map<Key, Value>& m) : m_(m) {
-//     for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it)
-//       readset_.insert(it->first);
-//   }
-
-//   Expect* clone() const {             // Virtual constructor (copying)
-//     Expect* clone = new Expect(map<Key, Value>(m_));
-//     this->CopyTxnInternals(clone);
-//     return clone;
-//   }
-
-//   virtual void Run() {
-//     Value result;
-//     for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it) {
-//       // If we didn't find it, this txn is doomed to fail, do not retry.
-//       if (!Read(it->first, &result)) {
-//         ABORT;
-//       }
-//       // If we find it and there is another value => write skew problem?
-//       // else if (result != it->second) {
-//       //   printf("write-skew?\n");
-//       // }
-//     }
-//     //COMMIT;
-//   }
-
-//  private:
-//   map<Key, Value> m_;
-// };
-
-// // Inserts all pairs in the map 'm'.
-// class Put : public Txn {
-//  public:
-//   Put(const map<Key, Value>& m) : m_(m) {
-//     for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it)
-//       writeset_.insert(it->first);
-//   }
-
-//   Put* clone() const {             // Virtual constructor (copying)
-//     Put* clone = new Put(map<Key, Value>(m_));
-//     this->CopyTxnInternals(clone);
-//     return clone;
-//   }
-
-//   virtual void Run() {
-//     for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it) {
-//       Version * to_insert = new Version;
-//       Write(it->first, it->second, to_insert);
-//     }
-//     //COMMIT;
-//   }
-
-//  private:
-//   map<Key, Value> m_;
-// };
+// Reads all keys in the map 'm' from the checking table. Commits if every
+// record exists and holds the value given for it, else aborts.
+class Expect : public Txn {
+ public:
+  Expect(const map<Key, Value>& m) : m_(m) {
+    read_only_ = true;
+    InitPrivateSets();
+    for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it)
+      readset_[CHECKING].insert(it->first);
+  }
+
+  Expect* clone() const {             // Virtual constructor (copying)
+    Expect* clone = new Expect(m_);
+    this->CopyTxnInternals(clone);
+    return clone;
+  }
+
+  virtual void Run() {
+    Value result;
+    for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it) {
+      if (!Read(it->first, &result, CHECKING) || result != it->second) {
+        ABORT;
+      }
+    }
+    COMMIT;
+  }
+
+ private:
+  map<Key, Value> m_;
+};
+
+// Writes all pairs in the map 'm' to the checking table.
+class Put : public Txn {
+ public:
+  Put(const map<Key, Value>& m) : m_(m) {
+    InitPrivateSets();
+    for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it)
+      writeset_[CHECKING].insert(it->first);
+  }
+
+  Put* clone() const {             // Virtual constructor (copying)
+    Put* clone = new Put(m_);
+    this->CopyTxnInternals(clone);
+    return clone;
+  }
+
+  virtual void Run() {
+    for (map<Key, Value>::iterator it = m_.begin(); it != m_.end(); ++it) {
+      Version * to_insert = NewVersion();
+      Write(it->first, it->second, to_insert, CHECKING);
+    }
+  }
+
+ private:
+  map<Key, Value> m_;
+};
 
 // Read-modify-write transaction.
 class RMW : public Txn {
  public:
   explicit RMW(double time = 0) : time_(time) {}
-  RMW(const vector<set<Key>>& writeset, double time = 0) : time_(time) {
+  RMW(const vector<KeySet>& writeset, double time = 0) : time_(time) {
+    InitPrivateSets(writeset.size());
     writeset_ = writeset;
   }
-  RMW(const vector<set<Key>>& readset, const vector<set<Key>>& writeset, double time = 0)
+  RMW(const vector<KeySet>& readset, const vector<KeySet>& writeset, double time = 0)
       : time_(time) {
+    InitPrivateSets(writeset.size());
     readset_ = readset;
     writeset_ = writeset;
   }
@@ -117,34 +117,11 @@ class RMW : public Txn {
     }
   }
 
-  void InitPrivateSets() {
-    set<Key> temp1;
-    set<Key> temp2;
-    readset_.push_back(temp1);
-    readset_.push_back(temp2);
-    set<Key> temp3;
-    set<Key> temp4;
-    writeset_.push_back(temp3);
-    writeset_.push_back(temp4);
-
-    map<Key, Version*> t1;
-    map<Key, Version*> t2;
-    reads_.push_back(t1);
-    reads_.push_back(t2);
-    map<Key, Version*> t3;
-    map<Key, Version*> t4;
-    writes_.push_back(t3);
-    writes_.push_back(t4);
-    map<Key, Version*> t5;
-    map<Key, Version*> t6;
-    vals_.push_back(t5);
-    vals_.push_back(t6);
-
-  }
-
-  // Constructor with randomized read/write sets
+  // Constructor with randomized read/write sets. Without writes the txn is
+  // declared read-only.
   RMW(int dbsize, int readsetsize, int writesetsize, double time = 0)
       : time_(time) {
+    read_only_ = writesetsize == 0;
     // Make sure we can find enough unique keys.
     DCHECK(dbsize >= readsetsize + writesetsize);
     // Initialize empty sets
@@ -177,6 +154,30 @@ class RMW : public Txn {
 
   }
 
+  // Constructor with randomized read/write sets spread over every table of
+  // 'catalog'. Each key goes to a random table and is drawn from that table's
+  // key range. Without writes the txn is declared read-only.
+  RMW(const Catalog& catalog, int readsetsize, int writesetsize, double time = 0)
+      : time_(time) {
+    read_only_ = writesetsize == 0;
+    InitPrivateSets(catalog.TableCount());
+
+    for (int i = 0; i < readsetsize + writesetsize; i++) {
+      TableType table = static_cast<TableType>(rand() % catalog.TableCount());
+      const TableSpec& spec = catalog.Spec(table);
+      // Make sure we can find enough unique keys.
+      DCHECK(spec.rows_ > readset_[table].size() + writeset_[table].size());
+      Key key;
+      do {
+        key = spec.first_key_ + rand() % spec.rows_;
+      } while (readset_[table].count(key) || writeset_[table].count(key));
+      if (i < readsetsize)
+        readset_[table].insert(key);
+      else
+        writeset_[table].insert(key);
+    }
+  }
+
   RMW* clone() const {             // Virtual constructor (copying)
     RMW* clone = new RMW(time_);
     this->CopyTxnInternals(clone);
@@ -186,14 +187,14 @@ class RMW : public Txn {
   void ReadWriteTable(const TableType& table) {
     // Read everything in readset.
     Value result;
-    for (set<Key>::iterator it = readset_[table].begin(); it != readset_[table].end(); ++it) {
+    for (KeySet::iterator it = readset_[table].begin(); it != readset_[table].end(); ++it) {
       Read(*it, &result, table);
     }
 
     // Increment length of everything in writeset.
-    for (set<Key>::iterator it = writeset_[table].begin(); it != writeset_[table].end();
+    for (KeySet::iterator it = writeset_[table].begin(); it != writeset_[table].end();
          ++it) {
-      Version * to_insert = new Version;
+      Version * to_insert = NewVersion();
       result = 0;
       Read(*it, &result, table);
       Write(*it, result + 1, to_insert, table);
@@ -201,16 +202,15 @@ class RMW : public Txn {
   }
 
   virtual void Run() {
-    TableType table = CHECKING;
-    // Execute everything in our read/write sets for CHECKING
-    ReadWriteTable(table);
-    // Now do the same for the SAVINGS table
-    table = SAVINGS;
-    ReadWriteTable(table);
+    // Execute everything in our read/write sets, one table at a time
+    for (size_t table = 0; table < readset_.size(); ++table) {
+      ReadWriteTable(static_cast<TableType>(table));
+    }
 
-    // Run while loop to simulate the txn logic(duration is time_).
+    // Run while loop to simulate the txn logic(duration is time_), unless
+    // the txn is doomed.
     double begin = GetTime();
-    while (GetTime() - begin < time_) {
+    while (!Doomed() && GetTime() - begin < time_) {
       for (int i = 0;i < 1000; i++) {
         int x = 100;
         x = x + 2;
@@ -226,44 +226,27 @@ class RMW : public Txn {
   double time_;
 };
 
+// Predicate that the checking and savings balances of account 'key' add up
+// to at least 'amount'.
+inline Predicate BalanceCovers(Key key, Value amount) {
+  return Predicate(CMP_GE, amount).Plus(CHECKING, key).Plus(SAVINGS, key);
+}
+
 // WriteCheck txns to deal with write-skew (used by a Checking/Savings system)
 class WriteCheck : public Txn {
  public:
   explicit WriteCheck(double time = 0) : time_(time) {}
-  WriteCheck(const vector<set<Key>>& writeset, double time = 0) : time_(time) {
+  WriteCheck(const vector<KeySet>& writeset, double time = 0) : time_(time) {
+    InitPrivateSets(writeset.size());
     writeset_ = writeset;
   }
-  WriteCheck(const vector<set<Key>>& readset, const vector<set<Key>>& writeset, double time = 0)
+  WriteCheck(const vector<KeySet>& readset, const vector<KeySet>& writeset, double time = 0)
       : time_(time) {
+    InitPrivateSets(writeset.size());
     readset_ = readset;
     writeset_ = writeset;
   }
 
-  void InitPrivateSets() {
-    set<Key> temp1;
-    set<Key> temp2;
-    readset_.push_back(temp1);
-    readset_.push_back(temp2);
-    set<Key> temp3;
-    set<Key> temp4;
-    writeset_.push_back(temp3);
-    writeset_.push_back(temp4);
-
-    map<Key, Version*> t1;
-    map<Key, Version*> t2;
-    reads_.push_back(t1);
-    reads_.push_back(t2);
-    map<Key, Version*> t3;
-    map<Key, Version*> t4;
-    writes_.push_back(t3);
-    writes_.push_back(t4);
-    map<Key, Version*> t5;
-    map<Key, Version*> t6;
-    vals_.push_back(t5);
-    vals_.push_back(t6);
-
-  }
-
   // Constructor with randomized read sets
   // Required: readsetsize == writesetsize
   WriteCheck(int dbsize, int setsize, double time = 0)
@@ -282,7 +265,6 @@ class WriteCheck : public Txn {
       // checking and savings.
       readset_[SAVINGS].insert(key);
       writeset_[CHECKING].insert(key);
-      constraintset_.insert(key);
     }
 
   }
@@ -293,98 +275,27 @@ class WriteCheck : public Txn {
     return clone;
   }
 
-  // Just readset?
-  // This functions checks our readset again and creates a constraint checking
-  // struct and compares it with the original one. Returns true if they're
-  // the same, returns false otherwise.
-  virtual bool Validate() {
-    vector<bool>::iterator it_v = path_.begin();
-    for (set<Key>::iterator it = constraintset_.begin(); it != constraintset_.end(); ++it, ++it_v) {
-      if (!ValidatePath(*it, *it_v)) { // This must be done before committing, right?
-        return false;
-      }
-    }
-    return true;
-  }
-
-  // Constructs a path and compares with path_ while doing so.
-  // Returns true if the constructed path matches with path_'s, otherwise
-  // returns false.
-  bool ValidatePath(const Key& key, const bool& path_value) {
-    Value result_chk = 0;
-    Value result_sav = 0;
-
-    // Here we read from both Checking and Saving tables and store those results
-    // in result_chk and result_sav respectively.
-    bool val = true;
-    GetChkAndSav(key, result_chk, result_sav, val);
-    // std::cout << "path_value: " << path_value << std::endl;
-    // std::cout << "result_chk: " << result_chk << std::endl;
-    // std::cout << "result_sav: " << result_sav << std::endl;
-    // std::cout << "constraint_: " << constraint_ << std::endl;
-    // As we construct the val_path, we check with the given path_value.
-    if (result_sav + result_chk >= constraint_) {
-      if (!path_value) {
-        return false;
-      }
-    }
-    else {
-      if (path_value) {
-        return false;
-      }
-    }
-    return true;
-  }
-
-  // this function reads in the appropriate OTHER table from the one we already read in
-  // Requires: val is already a value read in from table.
-  void GetChkAndSav(const Key& key, Value& result_chk, Value& result_sav, const bool& val) {
-    Read(key, &result_chk, CHECKING, val);
-    Read(key, &result_sav, SAVINGS, val);
-  }
-
-  // Note that this function is dependent on the constraint that we
-  // are checking. To add more constraints, this and ValidatePath would
-  // have to change.
-  Value ConstructPath(const Key& key, const Value& chk, const Value& sav) {
-     // read from savings TODO
-    Value deduction;
-    if (sav + chk >= constraint_) {
-        path_.push_back(true);
-        deduction = constraint_;
-    }
-    else {
-        path_.push_back(false);
-        deduction = constraint_ + 1;
-    }
-    return deduction;
-  }
-
+  // Charges a check of constraint_ to each account, plus a penalty of 1
+  // to those whose checking and savings together do not cover it.
   void ReadWrite() {
-    // Read everything in readset.
-    Value result_chk = 0;
-    Value result_sav = 0;
-    Value deduct = 0;
-    bool val = false;
-    for (set<Key>::iterator it = constraintset_.begin(); it != constraintset_.end(); ++it) {
-      GetChkAndSav(*it, result_chk, result_sav, val);
-      // We already read one result in, we need only read in from the other table
-      deduct = ConstructPath(*it, result_chk, result_sav);
-      Version * to_insert = new Version;
-      Write(*it, result_chk - deduct, to_insert, CHECKING);
+    Value chk = 0;
+    for (KeySet::iterator it = writeset_[CHECKING].begin();
+         it != writeset_[CHECKING].end(); ++it) {
+      Read(*it, &chk, CHECKING);
+      Value deduct = Check(BalanceCovers(*it, constraint_)) ? constraint_
+                                                            : constraint_ + 1;
+      Version * to_insert = NewVersion();
+      Write(*it, chk - deduct, to_insert, CHECKING);
     }
   }
 
-  // TODO: update this Run function to create some kind of struct that checks
-  // the path taken through the constraint checks.
   virtual void Run() {
-
-    // Execute everything in our read/write sets for Constraintset
     ReadWrite();
 
-    // Run while loop to simulate the txn logic(duration is time_).
+    // Run while loop to simulate the txn logic(duration is time_), unless
+    // the txn is doomed.
     double begin = GetTime();
-    while (GetTime() - begin < time_) {
+    while (!Doomed() && GetTime() - begin < time_) {
       for (int i = 0;i < 1000; i++) {
         int x = 100;
         x = x + 2;
@@ -398,9 +309,6 @@ class WriteCheck : public Txn {
 
  private:
   double time_;
-  // This is the path of the binary (for now) tree that we must compare
-  // against when validating for write-skew.
-  vector<bool> path_;
   // For WriteCheck txns, constraint_ is the upper bound on how much
   // money the customer must have for the txn to not penalize him/her.
   Value constraint_ = 5;
@@ -412,11 +320,13 @@ class WriteCheck : public Txn {
 class WithdrawSavings : public Txn {
  public:
   explicit WithdrawSavings(double time = 0) : time_(time) {}
-  WithdrawSavings(const vector<set<Key>>& writeset, double time = 0) : time_(time) {
+  WithdrawSavings(const vector<KeySet>& writeset, double time = 0) : time_(time) {
+    InitPrivateSets(writeset.size());
     writeset_ = writeset;
   }
-  WithdrawSavings(const vector<set<Key>>& readset, const vector<set<Key>>& writeset, double time = 0)
+  WithdrawSavings(const vector<KeySet>& readset, const vector<KeySet>& writeset, double time = 0)
       : time_(time) {
+    InitPrivateSets(writeset.size());
     readset_ = readset;
     writeset_ = writeset;
   }
@@ -439,130 +349,37 @@ class WithdrawSavings : public Txn {
       // checking and savings.
       readset_[CHECKING].insert(key);
       writeset_[SAVINGS].insert(key);
-      constraintset_.insert(key);
     }
 
   }
 
-  void InitPrivateSets() {
-    set<Key> temp1;
-    set<Key> temp2;
-    readset_.push_back(temp1);
-    readset_.push_back(temp2);
-    set<Key> temp3;
-    set<Key> temp4;
-    writeset_.push_back(temp3);
-    writeset_.push_back(temp4);
-
-    map<Key, Version*> t1;
-    map<Key, Version*> t2;
-    reads_.push_back(t1);
-    reads_.push_back(t2);
-    map<Key, Version*> t3;
-    map<Key, Version*> t4;
-    writes_.push_back(t3);
-    writes_.push_back(t4);
-    map<Key, Version*> t5;
-    map<Key, Version*> t6;
-    vals_.push_back(t5);
-    vals_.push_back(t6);
-
-  }
-
   WithdrawSavings* clone() const {             // Virtual constructor (copying)
     WithdrawSavings* clone = new WithdrawSavings(time_);
     this->CopyTxnInternals(clone);
     return clone;
   }
 
-  // Just readset?
-  // This functions checks our readset again and creates a constraint checking
-  // struct and compares it with the original one. Returns true if they're
-  // the same, returns false otherwise.
-  virtual bool Validate() {
-    vector<bool>::iterator it_v = path_.begin();
-    for (set<Key>::iterator it = constraintset_.begin(); it != constraintset_.end(); ++it, ++it_v) {
-      if (!ValidatePath(*it, *it_v)) { // This must be done before committing, right?
-        return false;
-      }
-    }
-    return true;
-  }
-
-  // Constructs a path and compares with path_ while doing so.
-  // Returns true if the constructed path matches with path_'s, otherwise
-  // returns false.
-  bool ValidatePath(const Key& key, const bool& path_value) {
-    Value result_chk = 0;
-    Value result_sav = 0;
-
-    // Here we read from both Checking and Saving tables and store those results
-    // in result_chk and result_sav respectively.
-    bool val = true;
-    GetChkAndSav(key, result_chk, result_sav, val);
-
-    // As we construct the val_path, we check with the given path_value.
-    if (result_sav + result_chk >= constraint_) {
-      if (!path_value) {
-        return false;
-      }
-    }
-    else {
-      if (path_value) {
-        return false;
-      }
-    }
-    return true;
-  }
-
-  // this function reads in the appropriate OTHER table from the one we already read in
-  // Requires: val is already a value read in from table.
-  void GetChkAndSav(const Key& key, Value& result_chk, Value& result_sav, const bool& val) {
-    Read(key, &result_chk, CHECKING, val);
-    Read(key, &result_sav, SAVINGS, val);
-  }
-
-  // Note that this function is dependent on the constraint that we
-  // are checking. To add more constraints, this and ValidatePath would
-  // have to change.
-  Value ConstructPath(const Key& key, const Value& chk, const Value& sav) {
-    Value deduction;
-    if (sav + chk >= constraint_) {
-        path_.push_back(true);
-        deduction = constraint_;
-    }
-    else {
-        path_.push_back(false);
-        deduction = constraint_ + 1;
-    }
-    return deduction;
-  }
-
+  // Withdraws constraint_ from each savings account, plus a penalty of 1
+  // from those whose checking and savings together do not cover it.
   void ReadWrite() {
-    // Read everything in readset.
-    Value result_chk = 0;
-    Value result_sav = 0;
-    Value deduct = 0;
-    bool val = false;
-    for (set<Key>::iterator it = constraintset_.begin(); it != constraintset_.end(); ++it) {
-      GetChkAndSav(*it, result_chk, result_sav, val);
-      // We already read one result in, we need only read in from the other table
-      deduct = ConstructPath(*it, result_chk, result_sav);
-      Version * to_insert = new Version;
-      Write(*it, result_sav - deduct, to_insert, SAVINGS);
+    Value sav = 0;
+    for (KeySet::iterator it = writeset_[SAVINGS].begin();
+         it != writeset_[SAVINGS].end(); ++it) {
+      Read(*it, &sav, SAVINGS);
+      Value deduct = Check(BalanceCovers(*it, constraint_)) ? constraint_
+                                                            : constraint_ + 1;
+      Version * to_insert = NewVersion();
+      Write(*it, sav - deduct, to_insert, SAVINGS);
     }
   }
 
-  // TODO: update this Run function to create some kind of struct that checks
-  // the path taken through the constraint checks.
   virtual void Run() {
-
-    // Execute everything in our read/write sets for Constraintset
     ReadWrite();
 
-    // Run while loop to simulate the txn logic(duration is time_).
+    // Run while loop to simulate the txn logic(duration is time_), unless
+    // the txn is doomed.
     double begin = GetTime();
-    while (GetTime() - begin < time_) {
+    while (!Doomed() && GetTime() - begin < time_) {
       for (int i = 0;i < 1000; i++) {
         int x = 100;
         x = x + 2;
@@ -576,9 +393,6 @@ class WithdrawSavings : public Txn {
 
  private:
   double time_;
-  // This is the path of the binary (for now) tree that we must compare
-  // against when validating for write-skew.
-  vector<bool> path_;
   // For WriteCheck txns, constraint_ is the upper bound on how much
   // money the customer must have for the txn to not penalize him/her.
   Value constraint_ = 5;
@@ -2,12 +2,155 @@
 
 #include "txn/txn.h"
 
+#include <atomic>
 #include <string>
 
 #include "txn/txn_processor.h"
 #include "txn/txn_types.h"
 #include "utils/testing.h"
 
+// One-shot flag that orders a test's steps against the txns it runs.
+class Latch {
+ public:
+  Latch() : set_(false) {}
+  void Set() { set_ = true; }
+  bool IsSet() const { return set_; }
+  void Wait() const {
+    while (!set_)
+      Sleep(0.0001);
+  }
+
+ private:
+  std::atomic<bool> set_;
+};
+
+// Txn on CHECKING record 'key' that sets 'started' once it runs and then
+// waits for 'release'. By then it has read the record at its snapshot and,
+// unless read-only, claimed it. Afterwards it reads the record, and
+// increments it unless read-only.
+class Gated : public Txn {
+ public:
+  Gated(Key key, bool read_only, Latch* started, Latch* release)
+      : value_(0), key_(key), started_(started), release_(release) {
+    InitPrivateSets();
+    read_only_ = read_only;
+    if (read_only)
+      readset_[CHECKING].insert(key);
+    else
+      writeset_[CHECKING].insert(key);
+  }
+
+  Gated* clone() const {
+    Gated* clone = new Gated(key_, read_only_, started_, release_);
+    this->CopyTxnInternals(clone);
+    return clone;
+  }
+
+  virtual void Run() {
+    started_->Set();
+    release_->Wait();
+    Read(key_, &value_, CHECKING);
+    if (!read_only_)
+      Write(key_, value_ + 1, NewVersion(), CHECKING);
+  }
+
+  Value value_;
+
+ private:
+  Key key_;
+  Latch* started_;
+  Latch* release_;
+};
+
+// Checks 'predicate' and records in CHECKING record 'key' whether it held
+// (1) or not (2), then sets 'checked' and waits for 'release' before it
+// finishes.
+class CheckAndRecord : public Txn {
+ public:
+  CheckAndRecord(const Predicate& predicate, Key key, Latch* checked,
+                 Latch* release)
+      : predicate_(predicate), key_(key), checked_(checked),
+        release_(release) {
+    InitPrivateSets();
+    for (int i = 0; i < predicate.TermCount(); i++)
+      readset_[predicate.GetTerm(i).table_].insert(predicate.GetTerm(i).key_);
+    writeset_[CHECKING].insert(key);
+  }
+
+  CheckAndRecord* clone() const {
+    CheckAndRecord* clone =
+        new CheckAndRecord(predicate_, key_, checked_, release_);
+    this->CopyTxnInternals(clone);
+    return clone;
+  }
+
+  virtual void Run() {
+    Write(key_, Check(predicate_) ? 1 : 2, NewVersion(), CHECKING);
+    checked_->Set();
+    release_->Wait();
+  }
+
+ private:
+  Predicate predicate_;
+  Key key_;
+  Latch* checked_;
+  Latch* release_;
+};
+
+// Retries every txn after 'delay' seconds, and counts how often it does.
+class CountingRetry : public ContentionManager {
+ public:
+  explicit CountingRetry(double delay) : delay_(delay), count_(0) {}
+
+  virtual bool Retry(int retries, double* delay) {
+    count_++;
+    *delay = delay_;
+    return true;
+  }
+
+  int Count() const { return count_; }
+
+ private:
+  double delay_;
+  std::atomic<int> count_;
+};
+
+// Runs a CheckAndRecord of 'predicate' into record 100 on a CSI processor
+// where 'before' has been put, and has 'during' put and committed after the
+// check but before the txn finishes. Returns the finished txn.
+static Txn* CheckDuringPut(const Predicate& predicate,
+                           const map<Key, Value>& before,
+                           const map<Key, Value>& during,
+                           TxnProcessor* p) {
+  p->NewTxnRequest(new Put(before));
+  delete p->GetTxnResult();
+
+  Latch checked;
+  Latch release;
+  p->NewTxnRequest(new CheckAndRecord(predicate, 100, &checked, &release));
+  checked.Wait();
+  p->NewTxnRequest(new Put(during));
+  // The check is held up until released, so this is the put.
+  Txn* put = p->GetTxnResult();
+  EXPECT_EQ(COMMITTED, put->Status());
+  delete put;
+  release.Set();
+  return p->GetTxnResult();
+}
+
+// Quiesce() called from a thread of its own, so the test can release the
+// txns it waits for.
+struct QuiesceCall {
+  TxnProcessor* processor;
+  bool quiesced;
+};
+
+static void* RunQuiesce(void* arg) {
+  QuiesceCall* call = reinterpret_cast<QuiesceCall*>(arg);
+  call->quiesced = call->processor->Quiesce();
+  return NULL;
+}
+
 TEST(NoopTest) {
   TxnProcessor p(SI);
 
@@ -40,22 +183,22 @@ TEST(PutTest) {
   q[1] = 2;
 
   p.NewTxnRequest(new Put(m));
-  p.GetTxnResult();
+  delete p.GetTxnResult();
 
-  p.NewTxnRequest(new Expect(n));  // Should abort (no key '0' exists)
+  p.NewTxnRequest(new Expect(n));  // Should abort (key 5 was never written)
   t = p.GetTxnResult();
   EXPECT_EQ(ABORTED, t->Status());
-  //delete t;
+  delete t;
 
   p.NewTxnRequest(new Expect(o));  // Should abort (wrong value for key)
   t = p.GetTxnResult();
   EXPECT_EQ(ABORTED, t->Status());
-  //delete t;
+  delete t;
 
   p.NewTxnRequest(new Expect(q));  // Should commit
   t = p.GetTxnResult();
   EXPECT_EQ(COMMITTED, t->Status());
-  //delete t;
+  delete t;
 
   END;
 }
@@ -79,8 +222,354 @@ TEST(PutMultipleTest) {
   END;
 }
 
+// WriteCheck and WithdrawSavings built from explicit key sets, run one after
+// the other on account 7, which starts with 0 in checking and 5 in savings.
+TEST(CheckingSavingsTest) {
+  TxnProcessor p(SI);
+
+  vector<KeySet> savings(2);
+  savings[SAVINGS].insert(7);
+  vector<KeySet> checking(2);
+  checking[CHECKING].insert(7);
+
+  // 0 + 5 covers a check of 5, so checking goes to -5.
+  p.NewTxnRequest(new WriteCheck(savings, checking));
+  Txn* t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  // -5 + 5 does not cover a withdrawal of 5, so savings loses 6.
+  p.NewTxnRequest(new WithdrawSavings(checking, savings));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  map<Key, Value> m;
+  m[7] = static_cast<Value>(-5);
+  p.NewTxnRequest(new Expect(m));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  END;
+}
+
+// Concurrent increments of the same two records. First updater wins, so
+// txns that lose a race restart, and every committed increment must show.
+TEST(LostUpdateTest) {
+  for (int mode = SI; mode <= CSI; mode++) {
+    ProcessorConfig config;
+    config.workers_ = 4;
+    TxnProcessor p(static_cast<CCMode>(mode), Catalog::Default(), config);
+
+    vector<KeySet> readset(2);
+    vector<KeySet> writeset(2);
+    writeset[CHECKING].insert(0);
+    writeset[CHECKING].insert(1);
+
+    int n = 3600;
+    int committed = 0;
+    for (int i = 0; i < n; i++)
+      p.NewTxnRequest(new RMW(readset, writeset));
+    for (int i = 0; i < n; i++) {
+      Txn* t = p.GetTxnResult();
+      if (t->Status() == COMMITTED)
+        committed++;
+      delete t;
+    }
+    EXPECT_EQ(n, committed);
+
+    map<Key, Value> m;
+    m[0] = committed;
+    m[1] = committed;
+    p.NewTxnRequest(new Expect(m));
+    Txn* t = p.GetTxnResult();
+    EXPECT_EQ(COMMITTED, t->Status());
+    delete t;
+  }
+
+  END;
+}
+
+// A predicate that another txn's commit makes false fails validation (or is
+// found out earlier), so the txn reruns and records the new outcome.
+TEST(ViolatedPredicateTest) {
+  ProcessorConfig config;
+  config.workers_ = 2;
+  TxnProcessor p(CSI, Catalog::Default(), config);
+
+  map<Key, Value> before;
+  before[1] = 3;
+  before[2] = 3;
+  map<Key, Value> during;
+  during[2] = 1;
+  Txn* t = CheckDuringPut(Predicate(CMP_GE, 5).Plus(CHECKING, 1)
+                                              .Plus(CHECKING, 2),
+                          before, during, &p);
+  EXPECT_EQ(COMMITTED, t->Status());
+  EXPECT_TRUE(t->Retries() > 0);
+  delete t;
+
+  map<Key, Value> m;
+  m[100] = 2;
+  p.NewTxnRequest(new Expect(m));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  END;
+}
+
+// Overwrites that leave the predicate as it was cost no restart.
+TEST(SatisfiedPredicateTest) {
+  ProcessorConfig config;
+  config.workers_ = 2;
+  TxnProcessor p(CSI, Catalog::Default(), config);
+
+  map<Key, Value> before;
+  before[1] = 3;
+  before[2] = 3;
+  map<Key, Value> during;
+  during[2] = 4;
+  Txn* t = CheckDuringPut(Predicate(CMP_GE, 5).Plus(CHECKING, 1)
+                                              .Plus(CHECKING, 2),
+                          before, during, &p);
+  EXPECT_EQ(COMMITTED, t->Status());
+  EXPECT_EQ(0, t->Retries());
+  delete t;
+
+  map<Key, Value> m;
+  m[100] = 1;
+  p.NewTxnRequest(new Expect(m));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  END;
+}
+
+// Every term of a predicate is validated, with its coefficient.
+TEST(MultiTermPredicateTest) {
+  ProcessorConfig config;
+  config.workers_ = 2;
+  TxnProcessor p(CSI, Catalog::Default(), config);
+  // 2 * x1 - x2 + x3 <= 10
+  Predicate predicate = Predicate(CMP_LE, 10).Plus(CHECKING, 1, 2)
+                                             .Plus(CHECKING, 2, -1)
+                                             .Plus(CHECKING, 3);
+
+  // 8 - 3 + 5 = 10 holds, and 8 - 2 + 5 = 11 does not.
+  map<Key, Value> before;
+  before[1] = 4;
+  before[2] = 3;
+  before[3] = 5;
+  map<Key, Value> during;
+  during[2] = 2;
+  Txn* t = CheckDuringPut(predicate, before, during, &p);
+  EXPECT_EQ(COMMITTED, t->Status());
+  EXPECT_TRUE(t->Retries() > 0);
+  delete t;
+
+  map<Key, Value> m;
+  m[100] = 2;
+  p.NewTxnRequest(new Expect(m));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  // 8 - 2 + 3 = 9 holds, and so does 8 - 4 + 3 = 7.
+  before[3] = 3;
+  during[2] = 4;
+  t = CheckDuringPut(predicate, before, during, &p);
+  EXPECT_EQ(COMMITTED, t->Status());
+  EXPECT_EQ(0, t->Retries());
+  delete t;
+
+  m[100] = 1;
+  p.NewTxnRequest(new Expect(m));
+  t = p.GetTxnResult();
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  END;
+}
+
+// Versions that garbage collection frees are recycled by later writes, so a
+// reader whose version went early would see a later value. Covers both
+// MVCCStorage and LockMVCCStorage (MVCC mode).
+TEST(GarbageCollectionTest) {
+  for (int mode = SI; mode <= MVCC; mode++) {
+    ProcessorConfig config;
+    config.workers_ = 4;
+    TxnProcessor p(static_cast<CCMode>(mode), Catalog::Default(), config);
+
+    vector<KeySet> readset(2);
+    vector<KeySet> writeset(2);
+    writeset[CHECKING].insert(0);
+
+    // The reader holds its version from before the first write until all
+    // writes are done.
+    Latch started;
+    Latch release;
+    Gated* reader = new Gated(0, true, &started, &release);
+    p.NewTxnRequest(reader);
+    started.Wait();
+    int n = 2000;
+    for (int i = 0; i < n; i++)
+      p.NewTxnRequest(new RMW(readset, writeset));
+    for (int i = 0; i < n; i++) {
+      Txn* t = p.GetTxnResult();
+      EXPECT_EQ(COMMITTED, t->Status());
+      delete t;
+    }
+    release.Set();
+    EXPECT_TRUE(p.GetTxnResult() == reader);
+    EXPECT_EQ(COMMITTED, reader->Status());
+    EXPECT_EQ(0, static_cast<int>(reader->value_));
+    delete reader;
+
+    // A reader that starts now sees every increment.
+    Latch now;
+    now.Set();
+    reader = new Gated(0, true, &started, &now);
+    p.NewTxnRequest(reader);
+    delete p.GetTxnResult();
+    EXPECT_EQ(n, static_cast<int>(reader->value_));
+  }
+
+  END;
+}
+
+// Quiesce() waits for queued requests and for restarted txns still backing
+// off, then turns new requests away.
+TEST(QuiesceTest) {
+  CountingRetry retry(0.001);
+  ProcessorConfig config;
+  config.workers_ = 4;
+  config.contention_manager_ = &retry;
+  TxnProcessor p(SI, Catalog::Default(), config);
+
+  // The blocker holds its claim on record 0 until released, so every RMW
+  // on it restarts until then.
+  Latch started;
+  Latch release;
+  p.NewTxnRequest(new Gated(0, false, &started, &release));
+  started.Wait();
+  vector<KeySet> readset(2);
+  vector<KeySet> writeset(2);
+  writeset[CHECKING].insert(0);
+  int n = 50;
+  for (int i = 0; i < n; i++)
+    p.NewTxnRequest(new RMW(readset, writeset));
+  while (retry.Count() < n)
+    Sleep(0.0001);
+
+  QuiesceCall call;
+  call.processor = &p;
+  call.quiesced = false;
+  pthread_t thread;
+  pthread_create(&thread, NULL, RunQuiesce, &call);
+
+  // New requests are handed back ABORTED without running once Quiesce() has
+  // been called, and run as usual before.
+  while (true) {
+    Txn* t = new Noop();
+    p.NewTxnRequest(t);
+    EXPECT_TRUE(p.GetTxnResult() == t);
+    bool turned_away = t->Status() == ABORTED;
+    delete t;
+    if (turned_away)
+      break;
+  }
+  release.Set();
+  pthread_join(thread, NULL);
+  EXPECT_TRUE(call.quiesced);
+
+  // Everything admitted is back already, committed.
+  Txn* txns[256];
+  int count = p.GetTxnResults(txns, 256, 0);
+  EXPECT_EQ(n + 1, count);
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(COMMITTED, txns[i]->Status());
+    delete txns[i];
+  }
+
+  // Stop() finds nothing left to do, and may be called again.
+  p.Stop();
+  p.Stop();
+
+  END;
+}
+
+// Quiesce() with a timeout gives up on a txn that takes longer, and Stop()
+// still lets it finish.
+TEST(QuiesceTimeoutTest) {
+  ProcessorConfig config;
+  config.workers_ = 2;
+  TxnProcessor p(SI, Catalog::Default(), config);
+
+  Latch started;
+  Latch release;
+  p.NewTxnRequest(new Gated(0, true, &started, &release));
+  started.Wait();
+  EXPECT_FALSE(p.Quiesce(0.01));
+  release.Set();
+  p.Stop();
+
+  Txn* t;
+  EXPECT_EQ(1, p.GetTxnResults(&t, 1, 0));
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+  EXPECT_TRUE(p.Quiesce());
+
+  END;
+}
+
+// A txn that keeps losing conflicts is handed back ABORTED once the
+// contention manager's retry budget is spent.
+TEST(RetryBudgetTest) {
+  BackoffManager backoff(0.001, 0.001, 100, 3, false);
+  ProcessorConfig config;
+  config.workers_ = 2;
+  config.contention_manager_ = &backoff;
+  TxnProcessor p(SI, Catalog::Default(), config);
+
+  // Holds its claim on record 100 until released.
+  Latch started;
+  Latch release;
+  Txn* blocker = new Gated(100, false, &started, &release);
+  p.NewTxnRequest(blocker);
+  started.Wait();
+
+  map<Key, Value> m;
+  m[100] = 5;
+  Txn* t = new Put(m);
+  p.NewTxnRequest(t);
+  EXPECT_TRUE(p.GetTxnResult() == t);
+  EXPECT_EQ(ABORTED, t->Status());
+  EXPECT_EQ(3, t->Retries());
+  delete t;
+
+  release.Set();
+  t = p.GetTxnResult();
+  EXPECT_TRUE(t == blocker);
+  EXPECT_EQ(COMMITTED, t->Status());
+  delete t;
+
+  END;
+}
+
 int main(int argc, char** argv) {
   NoopTest();
   PutTest();
   PutMultipleTest();
+  CheckingSavingsTest();
+  LostUpdateTest();
+  ViolatedPredicateTest();
+  SatisfiedPredicateTest();
+  MultiTermPredicateTest();
+  GarbageCollectionTest();
+  QuiesceTest();
+  QuiesceTimeoutTest();
+  RetryBudgetTest();
 }
@@ -170,7 +170,8 @@ class AtomicSet {
 ///
 /// Queue with atomic push and pop operations.
 ///
-/// @TODO(alex): This should use lower-contention synchronization.
+/// Mutex-based. utils/lockfree_queue.h has lock-free queues with the same
+/// interface.
 template<typename T>
 class AtomicQueue {
  public:
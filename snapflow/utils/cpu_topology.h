@@ -0,0 +1,245 @@
+/// @file
+///
+/// CPU topology discovery and thread placement.
+///
+/// CpuTopology reads /sys/devices/system/cpu to learn which core, package and
+/// NUMA node each CPU belongs to, restricted to the CPUs the process may run
+/// on (so taskset and cpusets are respected). Place() turns a pinning policy
+/// into one CPU per worker thread plus a CPU set for a coordinating thread.
+/// If /sys is unavailable every allowed CPU is treated as its own core on
+/// node 0.
+
+#ifndef _DB_UTILS_CPU_TOPOLOGY_H_
+#define _DB_UTILS_CPU_TOPOLOGY_H_
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+// How threads are spread over the CPUs.
+enum PinPolicy {
+  PIN_NONE,            // Leave placement to the OS.
+  PIN_COMPACT,         // Fill one core, then the next, node by node.
+  PIN_SCATTER,         // Alternate nodes, then cores, before SMT siblings.
+  PIN_PHYSICAL_CORES,  // One thread per physical core, no SMT siblings.
+  PIN_NUMA_NODE,       // Only the CPUs of one NUMA node, compactly.
+};
+
+// Where a coordinating thread (e.g. a scheduler) goes relative to the
+// workers.
+enum CoordinatorPlacement {
+  COORDINATOR_SHARED,     // Any of the workers' CPUs.
+  COORDINATOR_DEDICATED,  // The next CPU in policy order after the workers'.
+  COORDINATOR_UNPINNED,   // Leave it to the OS.
+};
+
+// Result of CpuTopology::Place(). A worker CPU of -1 means unpinned, as does
+// an empty 'coordinator_cpus_'.
+struct ThreadPlacement {
+  vector<int> worker_cpus_;
+  vector<int> coordinator_cpus_;
+};
+
+class CpuTopology {
+ public:
+  // Reads the topology of the CPUs the calling thread may run on.
+  static CpuTopology Detect() {
+    CpuTopology topology;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      for (int i = 0; i < CPU_SETSIZE; i++)
+        CPU_SET(i, &allowed);
+    }
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (!CPU_ISSET(i, &allowed))
+        continue;
+      Cpu cpu;
+      cpu.id_ = i;
+      cpu.core_ = ReadTopologyValue(i, "core_id", i);
+      cpu.package_ = ReadTopologyValue(i, "physical_package_id", 0);
+      cpu.node_ = ReadNode(i);
+      topology.cpus_.push_back(cpu);
+    }
+    std::sort(topology.cpus_.begin(), topology.cpus_.end(), CompactOrder);
+    return topology;
+  }
+
+  // Number of CPUs the process may run on.
+  int CpuCount() const { return cpus_.size(); }
+
+  // Returns the CPUs 'policy' allows, in the order threads should be placed
+  // on them. 'node' is only used by PIN_NUMA_NODE; a node without usable
+  // CPUs falls back to PIN_COMPACT. Empty for PIN_NONE.
+  vector<int> Order(PinPolicy policy, int node = 0) const {
+    vector<int> order;
+    switch (policy) {
+      case PIN_NONE:
+        break;
+
+      case PIN_COMPACT:
+        for (size_t i = 0; i < cpus_.size(); i++)
+          order.push_back(cpus_[i].id_);
+        break;
+
+      case PIN_PHYSICAL_CORES:
+        for (size_t i = 0; i < cpus_.size(); i++) {
+          if (i == 0 || !SameCore(cpus_[i], cpus_[i - 1]))
+            order.push_back(cpus_[i].id_);
+        }
+        break;
+
+      case PIN_NUMA_NODE:
+        for (size_t i = 0; i < cpus_.size(); i++) {
+          if (cpus_[i].node_ == node)
+            order.push_back(cpus_[i].id_);
+        }
+        if (order.empty())
+          return Order(PIN_COMPACT);
+        break;
+
+      case PIN_SCATTER: {
+        // cores[n][k][s] is SMT sibling s of the k-th core of the n-th node.
+        vector<vector<vector<int> > > cores;
+        for (size_t i = 0; i < cpus_.size(); i++) {
+          if (i == 0 || cpus_[i].node_ != cpus_[i - 1].node_)
+            cores.push_back(vector<vector<int> >());
+          if (i == 0 || !SameCore(cpus_[i], cpus_[i - 1]))
+            cores.back().push_back(vector<int>());
+          cores.back().back().push_back(cpus_[i].id_);
+        }
+        size_t max_cores = 0;
+        size_t max_siblings = 0;
+        for (size_t n = 0; n < cores.size(); n++) {
+          max_cores = std::max(max_cores, cores[n].size());
+          for (size_t k = 0; k < cores[n].size(); k++)
+            max_siblings = std::max(max_siblings, cores[n][k].size());
+        }
+        for (size_t s = 0; s < max_siblings; s++) {
+          for (size_t k = 0; k < max_cores; k++) {
+            for (size_t n = 0; n < cores.size(); n++) {
+              if (k < cores[n].size() && s < cores[n][k].size())
+                order.push_back(cores[n][k][s]);
+            }
+          }
+        }
+        break;
+      }
+    }
+    return order;
+  }
+
+  // Places 'workers' worker threads (0 means one per CPU in 'policy' order,
+  // less one for a dedicated coordinator) and a coordinating thread. Threads
+  // wrap around if there are more of them than CPUs.
+  ThreadPlacement Place(PinPolicy policy, int workers,
+                        CoordinatorPlacement coordinator,
+                        int node = 0) const {
+    vector<int> order = Order(policy, node);
+    if (workers <= 0) {
+      int cpus = policy == PIN_NONE ? CpuCount() : order.size();
+      workers = std::max(
+          1, cpus - (coordinator == COORDINATOR_DEDICATED ? 1 : 0));
+    }
+
+    ThreadPlacement placement;
+    for (int i = 0; i < workers; i++)
+      placement.worker_cpus_.push_back(
+          order.empty() ? -1 : order[i % order.size()]);
+
+    if (order.empty() || coordinator == COORDINATOR_UNPINNED)
+      return placement;
+    if (coordinator == COORDINATOR_DEDICATED) {
+      placement.coordinator_cpus_.push_back(order[workers % order.size()]);
+    } else {
+      placement.coordinator_cpus_ = placement.worker_cpus_;
+    }
+    return placement;
+  }
+
+ private:
+  struct Cpu {
+    int id_;
+    int core_;
+    int package_;
+    int node_;
+  };
+
+  // Node, then package, then core, so that SMT siblings are adjacent.
+  static bool CompactOrder(const Cpu& a, const Cpu& b) {
+    if (a.node_ != b.node_)
+      return a.node_ < b.node_;
+    if (a.package_ != b.package_)
+      return a.package_ < b.package_;
+    if (a.core_ != b.core_)
+      return a.core_ < b.core_;
+    return a.id_ < b.id_;
+  }
+
+  static bool SameCore(const Cpu& a, const Cpu& b) {
+    return a.node_ == b.node_ && a.package_ == b.package_ &&
+           a.core_ == b.core_;
+  }
+
+  // Reads /sys/devices/system/cpu/cpu<cpu>/topology/<name>.
+  static int ReadTopologyValue(int cpu, const char* name, int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+      return fallback;
+    int value;
+    if (fscanf(file, "%d", &value) != 1)
+      value = fallback;
+    fclose(file);
+    return value;
+  }
+
+  // The NUMA node of a CPU is the 'node<N>' link in its sysfs directory.
+  static int ReadNode(int cpu) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+      return 0;
+    int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "node", 4) == 0 &&
+          entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+        node = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+    return node;
+  }
+
+  vector<Cpu> cpus_;
+};
+
+// Sets the affinity of threads created with 'attr' to 'cpus'. Leaves 'attr'
+// alone if 'cpus' is empty or only holds -1.
+inline void SetAffinity(pthread_attr_t* attr, const vector<int>& cpus) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  bool any = false;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] >= 0) {
+      CPU_SET(cpus[i], &cpuset);
+      any = true;
+    }
+  }
+  if (any)
+    pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpuset);
+}
+
+#endif  // _DB_UTILS_CPU_TOPOLOGY_H_
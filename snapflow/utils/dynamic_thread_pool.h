@@ -71,10 +71,7 @@ class DynamicThreadPool : public ThreadPool {
       while (true) {
         // Run task_ any time it's not NULL.
         cv_.WaitWhileEq<Task*>(NULL, &task_);
-        task_->Run();
-
-        // 
-        delete task_;
+        RunPoolTask(task_);
         task_ = NULL;
         thread_pool_->available_threads_.Push(this);
       }
@@ -0,0 +1,230 @@
+/// @file
+///
+/// Sorted set and map containers for the handful of keys a txn touches.
+///
+/// FlatSet and FlatMap keep their elements sorted in one contiguous array,
+/// held inline in the object for up to N elements and on the heap beyond
+/// that, so building, copying and clearing a small one never touches malloc.
+/// Lookups scan the array while it is short (a tight loop over a few cache
+/// lines that the compiler can vectorize) and binary search it once it is
+/// longer. Inserts and erases shift the elements behind them.
+///
+/// Both follow std::set/std::map for the operations they offer. Iterators are
+/// plain pointers and, as with a vector, are invalidated by inserts and
+/// erases. Keys and values must be trivially copyable.
+
+#ifndef _DB_UTILS_FLAT_SET_H_
+#define _DB_UTILS_FLAT_SET_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <utility>
+
+// Arrays up to this long are searched linearly.
+#define FLAT_LINEAR_SEARCH 32
+
+/// @class SmallArray<E, N>
+///
+/// Array of trivially copyable elements, inline up to N of them. The storage
+/// of FlatSet and FlatMap, and usable on its own as a small vector.
+template<typename E, int N>
+class SmallArray {
+ public:
+  SmallArray() : data_(inline_), size_(0), capacity_(N) {}
+
+  SmallArray(const SmallArray& other)
+      : data_(inline_), size_(0), capacity_(N) {
+    *this = other;
+  }
+
+  SmallArray& operator=(const SmallArray& other) {
+    if (this != &other) {
+      Reserve(other.size_);
+      memcpy(data_, other.data_, other.size_ * sizeof(E));
+      size_ = other.size_;
+    }
+    return *this;
+  }
+
+  ~SmallArray() {
+    if (data_ != inline_)
+      delete[] data_;
+  }
+
+  E* Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+  // Opens a gap at 'index' and returns the (uninitialized) element there.
+  E* InsertAt(size_t index) {
+    if (size_ == capacity_)
+      Reserve(2 * capacity_);
+    memmove(data_ + index + 1, data_ + index, (size_ - index) * sizeof(E));
+    size_++;
+    return data_ + index;
+  }
+
+  // Returns a new (uninitialized) element at the end.
+  E* Append() { return InsertAt(size_); }
+
+  void EraseAt(size_t index) {
+    memmove(data_ + index, data_ + index + 1,
+            (size_ - index - 1) * sizeof(E));
+    size_--;
+  }
+
+  // Keeps the heap array, if any, for reuse.
+  void Clear() { size_ = 0; }
+
+ private:
+  void Reserve(size_t capacity) {
+    if (capacity <= capacity_)
+      return;
+    E* data = new E[capacity];
+    memcpy(data, data_, size_ * sizeof(E));
+    if (data_ != inline_)
+      delete[] data_;
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  E* data_;
+  size_t size_;
+  size_t capacity_;
+  E inline_[N];
+};
+
+// Returns the index of the first element of 'data[0..size-1]' (sorted by
+// key(element)) whose key is not less than 'key'.
+template<typename E, typename K, typename KeyOf>
+inline size_t FlatLowerBound(const E* data, size_t size, const K& key,
+                             KeyOf key_of) {
+  if (size <= FLAT_LINEAR_SEARCH) {
+    size_t i = 0;
+    while (i < size && key_of(data[i]) < key)
+      i++;
+    return i;
+  }
+  size_t lo = 0;
+  size_t hi = size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (key_of(data[mid]) < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/// @class FlatSet<K, N>
+///
+/// Sorted set of keys, inline up to N of them.
+template<typename K, int N = 8>
+class FlatSet {
+ public:
+  typedef const K* iterator;
+  typedef const K* const_iterator;
+
+  iterator begin() const { return keys_.Data(); }
+  iterator end() const { return keys_.Data() + keys_.Size(); }
+  size_t size() const { return keys_.Size(); }
+  bool empty() const { return keys_.Size() == 0; }
+  void clear() { keys_.Clear(); }
+
+  iterator find(const K& key) const {
+    size_t i = LowerBound(key);
+    return i < keys_.Size() && keys_.Data()[i] == key ? begin() + i : end();
+  }
+
+  size_t count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+  std::pair<iterator, bool> insert(const K& key) {
+    size_t i = LowerBound(key);
+    if (i < keys_.Size() && keys_.Data()[i] == key)
+      return std::make_pair(begin() + i, false);
+    *keys_.InsertAt(i) = key;
+    return std::make_pair(begin() + i, true);
+  }
+
+  size_t erase(const K& key) {
+    size_t i = LowerBound(key);
+    if (i == keys_.Size() || !(keys_.Data()[i] == key))
+      return 0;
+    keys_.EraseAt(i);
+    return 1;
+  }
+
+ private:
+  static const K& KeyOf(const K& key) { return key; }
+
+  size_t LowerBound(const K& key) const {
+    return FlatLowerBound(keys_.Data(), keys_.Size(), key, KeyOf);
+  }
+
+  SmallArray<K, N> keys_;
+};
+
+/// @class FlatMap<K, V, N>
+///
+/// Sorted map, inline up to N entries. Entries have 'first' and 'second'
+/// like the pairs in a std::map.
+template<typename K, typename V, int N = 8>
+class FlatMap {
+ public:
+  struct Entry {
+    K first;
+    V second;
+  };
+  typedef Entry* iterator;
+  typedef const Entry* const_iterator;
+
+  iterator begin() { return entries_.Data(); }
+  iterator end() { return entries_.Data() + entries_.Size(); }
+  const_iterator begin() const { return entries_.Data(); }
+  const_iterator end() const { return entries_.Data() + entries_.Size(); }
+  size_t size() const { return entries_.Size(); }
+  bool empty() const { return entries_.Size() == 0; }
+  void clear() { entries_.Clear(); }
+
+  iterator find(const K& key) {
+    size_t i = LowerBound(key);
+    return i < entries_.Size() && entries_.Data()[i].first == key
+               ? begin() + i : end();
+  }
+
+  const_iterator find(const K& key) const {
+    return const_cast<FlatMap*>(this)->find(key);
+  }
+
+  size_t count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+  // Value-initializes the entry for 'key' if there is none.
+  V& operator[](const K& key) {
+    size_t i = LowerBound(key);
+    if (i < entries_.Size() && entries_.Data()[i].first == key)
+      return entries_.Data()[i].second;
+    Entry* entry = entries_.InsertAt(i);
+    entry->first = key;
+    entry->second = V();
+    return entry->second;
+  }
+
+  size_t erase(const K& key) {
+    size_t i = LowerBound(key);
+    if (i == entries_.Size() || !(entries_.Data()[i].first == key))
+      return 0;
+    entries_.EraseAt(i);
+    return 1;
+  }
+
+ private:
+  static const K& KeyOf(const Entry& entry) { return entry.first; }
+
+  size_t LowerBound(const K& key) const {
+    return FlatLowerBound(entries_.Data(), entries_.Size(), key, KeyOf);
+  }
+
+  SmallArray<Entry, N> entries_;
+};
+
+#endif  // _DB_UTILS_FLAT_SET_H_
@@ -0,0 +1,129 @@
+// Checks FlatSet and FlatMap against the std::set/std::map behavior they
+// promise, both while inline and after spilling to the heap.
+
+#include "utils/flat_set.h"
+
+#include <stdlib.h>
+#include <map>
+#include <set>
+
+#include "utils/testing.h"
+
+TEST(FlatSetSpillTest) {
+  FlatSet<int, 16> s;
+  for (int i = 0; i < 16; i++)
+    EXPECT_TRUE(s.insert(i).second);
+  EXPECT_EQ(16, static_cast<int>(s.size()));
+  // Keys inserted before the spill must survive it.
+  for (int i = 16; i < 100; i++)
+    EXPECT_TRUE(s.insert(i).second);
+  EXPECT_EQ(100, static_cast<int>(s.size()));
+  for (int i = 0; i < 100; i++)
+    EXPECT_EQ(1, static_cast<int>(s.count(i)));
+  EXPECT_EQ(0, static_cast<int>(s.count(100)));
+
+  // Copies of a spilled set get their own array.
+  FlatSet<int, 16> t = s;
+  s.erase(50);
+  EXPECT_EQ(1, static_cast<int>(t.count(50)));
+  EXPECT_EQ(0, static_cast<int>(s.count(50)));
+
+  END;
+}
+
+TEST(FlatSetOrderTest) {
+  FlatSet<int, 16> s;
+  std::set<int> expected;
+  srand(42);
+  // Enough keys to be past FLAT_LINEAR_SEARCH, so binary search is covered.
+  for (int i = 0; i < 200; i++) {
+    int key = rand() % 100;
+    EXPECT_EQ(expected.insert(key).second, s.insert(key).second);
+  }
+  EXPECT_EQ(expected.size(), s.size());
+
+  std::set<int>::iterator e = expected.begin();
+  for (FlatSet<int, 16>::iterator it = s.begin(); it != s.end(); ++it, ++e)
+    EXPECT_EQ(*e, *it);
+
+  END;
+}
+
+TEST(FlatSetFindEraseTest) {
+  FlatSet<int, 4> s;
+  for (int i = 0; i < 10; i++)
+    s.insert(2 * i);
+
+  EXPECT_TRUE(s.find(6) != s.end());
+  EXPECT_EQ(6, *s.find(6));
+  EXPECT_TRUE(s.find(7) == s.end());
+  EXPECT_FALSE(s.insert(6).second);
+
+  EXPECT_EQ(1, static_cast<int>(s.erase(6)));
+  EXPECT_EQ(0, static_cast<int>(s.erase(6)));
+  EXPECT_EQ(0, static_cast<int>(s.erase(7)));
+  EXPECT_TRUE(s.find(6) == s.end());
+  EXPECT_EQ(9, static_cast<int>(s.size()));
+  EXPECT_EQ(4, *s.find(4));
+  EXPECT_EQ(8, *s.find(8));
+
+  END;
+}
+
+TEST(FlatSetClearTest) {
+  FlatSet<int, 4> s;
+  for (int i = 0; i < 50; i++)
+    s.insert(i);
+  s.clear();
+  EXPECT_TRUE(s.empty());
+  EXPECT_TRUE(s.begin() == s.end());
+  EXPECT_EQ(0, static_cast<int>(s.count(3)));
+
+  // The set is usable again after clear().
+  for (int i = 49; i >= 0; i--)
+    s.insert(i);
+  EXPECT_EQ(50, static_cast<int>(s.size()));
+  EXPECT_EQ(0, *s.begin());
+
+  END;
+}
+
+TEST(FlatMapTest) {
+  FlatMap<int, int, 16> m;
+  std::map<int, int> expected;
+  srand(7);
+  for (int i = 0; i < 300; i++) {
+    int key = rand() % 100;
+    m[key] += i;
+    expected[key] += i;
+  }
+  EXPECT_EQ(expected.size(), m.size());
+
+  std::map<int, int>::iterator e = expected.begin();
+  for (FlatMap<int, int, 16>::iterator it = m.begin(); it != m.end();
+       ++it, ++e) {
+    EXPECT_EQ(e->first, it->first);
+    EXPECT_EQ(e->second, it->second);
+  }
+
+  int key = expected.begin()->first;
+  EXPECT_EQ(expected[key], m.find(key)->second);
+  EXPECT_EQ(1, static_cast<int>(m.erase(key)));
+  EXPECT_TRUE(m.find(key) == m.end());
+  EXPECT_EQ(0, static_cast<int>(m.count(key)));
+  // operator[] value-initializes a new entry.
+  EXPECT_EQ(0, m[key]);
+
+  m.clear();
+  EXPECT_TRUE(m.empty());
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  FlatSetSpillTest();
+  FlatSetOrderTest();
+  FlatSetFindEraseTest();
+  FlatSetClearTest();
+  FlatMapTest();
+}
@@ -0,0 +1,40 @@
+/// @file
+///
+/// Thin wrappers around the Linux futex system call, for threads that sleep on
+/// a 32-bit atomic word until another thread changes it.
+///
+/// The usual pattern: the waiter reads the word, announces itself (so that
+/// wakers know a wakeup is needed), checks its condition once more and then
+/// calls FutexWait() with the value it read. A waker makes the condition true,
+/// changes the word and calls FutexWake(). If the word changed after the
+/// waiter read it, FutexWait() returns immediately, so the wakeup cannot be
+/// lost.
+
+#ifndef _DB_UTILS_FUTEX_H_
+#define _DB_UTILS_FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+// Sleeps until 'word' is woken by FutexWake(), as long as it still holds
+// 'expected'. Gives up after 'timeout' seconds if 'timeout' is positive. May
+// also return spuriously, so callers recheck their condition.
+inline void FutexWait(std::atomic<int>* word, int expected,
+                      double timeout = 0) {
+  struct timespec ts;
+  ts.tv_sec = static_cast<time_t>(timeout);
+  ts.tv_nsec = static_cast<long>((timeout - ts.tv_sec) * 1e9);
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE,
+          expected, timeout > 0 ? &ts : NULL, NULL, 0);
+}
+
+// Wakes up to 'count' threads sleeping on 'word'.
+inline void FutexWake(std::atomic<int>* word, int count) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE,
+          count, NULL, NULL, 0);
+}
+
+#endif  // _DB_UTILS_FUTEX_H_
@@ -0,0 +1,488 @@
+/// @file
+///
+/// Lock-free multi-producer/multi-consumer queues with the same interface as
+/// AtomicQueue.
+///
+/// BoundedQueue is a fixed-capacity ring buffer in which every cell carries a
+/// sequence number (D. Vyukov's bounded MPMC queue): producers and consumers
+/// each claim a position with one CAS and hand the cell over by bumping its
+/// sequence number, so the two ends never touch the same cache line unless the
+/// queue is nearly empty or full.
+///
+/// SegmentedQueue is unbounded: a linked list of fixed-size segments, each
+/// filled once by fetch-and-add on its enqueue index and drained by
+/// fetch-and-add on its dequeue index (as in Ramalhete and Correia's
+/// FAAArrayQueue). Drained segments are reclaimed with hazard pointers. It
+/// also moves whole batches of elements, claiming all the cells a batch uses
+/// in one segment with a single atomic operation.
+///
+/// Single-threaded performance (Push/Pop pair) and multi-threaded throughput
+/// are measured by utils/lockfree_queue_test.
+
+#ifndef _DB_UTILS_LOCKFREE_QUEUE_H_
+#define _DB_UTILS_LOCKFREE_QUEUE_H_
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "utils/mutex.h"
+
+using std::vector;
+
+// Most threads that may use lock-free queues at the same time.
+#define HAZARD_SLOTS 256
+
+// Returns the calling thread's hazard pointer slot, an index in
+// [0, HAZARD_SLOTS) that no other live thread holds. The slot is claimed on
+// first use and given back when the thread exits.
+inline int HazardSlot() {
+  static std::atomic<bool> used[HAZARD_SLOTS];
+
+  struct Holder {
+    Holder() : slot_(-1) {
+      for (int i = 0; i < HAZARD_SLOTS; i++) {
+        bool expected = false;
+        if (!used[i].load(std::memory_order_relaxed) &&
+            used[i].compare_exchange_strong(expected, true)) {
+          slot_ = i;
+          return;
+        }
+      }
+      fprintf(stderr, "HazardSlot: more than %d threads\n", HAZARD_SLOTS);
+      abort();
+    }
+    ~Holder() { used[slot_].store(false, std::memory_order_release); }
+    int slot_;
+  };
+
+  static thread_local Holder holder;
+  return holder.slot_;
+}
+
+/// @class BoundedQueue<T>
+///
+/// Fixed-capacity lock-free queue.
+template<typename T>
+class BoundedQueue {
+ public:
+  // 'capacity' is rounded up to a power of two.
+  explicit BoundedQueue(int capacity = 1024) : enq_(0), deq_(0) {
+    capacity_ = 1;
+    while (capacity_ < static_cast<uint64_t>(capacity))
+      capacity_ <<= 1;
+    cells_ = new Cell[capacity_];
+    for (uint64_t i = 0; i < capacity_; i++)
+      cells_[i].seq_.store(i, std::memory_order_relaxed);
+  }
+
+  ~BoundedQueue() { delete[] cells_; }
+
+  // Returns the number of elements currently in the queue.
+  int Size() {
+    int64_t size = static_cast<int64_t>(enq_.load() - deq_.load());
+    return size < 0 ? 0 : size;
+  }
+
+  // Pushes 'item' onto the queue, waiting for room if the queue is full.
+  void Push(const T& item) {
+    while (!PushNonBlocking(item))
+      sched_yield();
+  }
+
+  // If the queue is non-empty, sets '*result' equal to the front element,
+  // pops the front element from the queue, and returns true, otherwise
+  // returns false.
+  bool Pop(T* result) {
+    return PopNonBlocking(result);
+  }
+
+  // If the queue has room, pushes and returns true, else immediately returns
+  // false.
+  bool PushNonBlocking(const T& item) {
+    uint64_t pos = enq_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & (capacity_ - 1)];
+      int64_t diff = static_cast<int64_t>(
+          cell->seq_.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (enq_.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;  // Full.
+      } else {
+        pos = enq_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->item_ = item;
+    cell->seq_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Same as Pop(); popping never blocks.
+  bool PopNonBlocking(T* result) {
+    uint64_t pos = deq_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & (capacity_ - 1)];
+      int64_t diff = static_cast<int64_t>(
+          cell->seq_.load(std::memory_order_acquire) - (pos + 1));
+      if (diff == 0) {
+        if (deq_.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;  // Empty.
+      } else {
+        pos = deq_.load(std::memory_order_relaxed);
+      }
+    }
+    *result = cell->item_;
+    cell->seq_.store(pos + capacity_, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // A cell at position p is free for the producer of p when seq_ == p, and
+  // holds an item for the consumer of p when seq_ == p + 1.
+  struct Cell {
+    std::atomic<uint64_t> seq_;
+    T item_;
+  };
+
+  uint64_t capacity_;
+  Cell* cells_;
+
+  // Producers and consumers claim positions here; keep the two counters on
+  // separate cache lines.
+  char pad0_[64];
+  std::atomic<uint64_t> enq_;
+  char pad1_[64 - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> deq_;
+  char pad2_[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+/// @class SegmentedQueue<T>
+///
+/// Unbounded lock-free queue. T must be default-constructible.
+template<typename T>
+class SegmentedQueue {
+ public:
+  SegmentedQueue() {
+    Segment* first = new Segment(0);
+    head_.store(first);
+    tail_.store(first);
+    for (int i = 0; i < HAZARD_SLOTS; i++)
+      hazards_[i].store(NULL, std::memory_order_relaxed);
+  }
+
+  // Requires: no other thread is using the queue.
+  ~SegmentedQueue() {
+    Segment* segment = head_.load();
+    while (segment != NULL) {
+      Segment* next = segment->next_.load();
+      delete segment;
+      segment = next;
+    }
+    for (size_t i = 0; i < retired_.size(); i++)
+      delete retired_[i];
+  }
+
+  // Returns the number of elements currently in the queue. Approximate while
+  // other threads are pushing or popping.
+  int Size() {
+    std::atomic<Segment*>& hazard = hazards_[HazardSlot()];
+    Segment* tail = Protect(tail_, &hazard);
+    uint64_t pushed = tail->base_ + Clamp(tail->enq_.load());
+    Segment* head = Protect(head_, &hazard);
+    uint64_t popped = head->base_ + Clamp(head->deq_.load());
+    hazard.store(NULL, std::memory_order_release);
+    return pushed > popped ? pushed - popped : 0;
+  }
+
+  // Atomically pushes 'item' onto the queue.
+  void Push(const T& item) {
+    std::atomic<Segment*>& hazard = hazards_[HazardSlot()];
+    while (true) {
+      Segment* tail = Protect(tail_, &hazard);
+      uint64_t idx = tail->enq_.fetch_add(1);
+      if (idx < SEGMENT_SIZE) {
+        Cell& cell = tail->cells_[idx];
+        cell.item_ = item;
+        int expected = EMPTY;
+        if (cell.state_.compare_exchange_strong(expected, FULL,
+                                                std::memory_order_acq_rel))
+          break;
+        // A consumer gave up waiting for this cell; take another one.
+        continue;
+      }
+
+      // 'tail' is full. Append a new segment that already holds 'item', or
+      // help whoever appended one first.
+      Segment* next = tail->next_.load(std::memory_order_acquire);
+      if (next == NULL) {
+        Segment* segment = new Segment(tail->base_ + SEGMENT_SIZE);
+        segment->cells_[0].item_ = item;
+        segment->cells_[0].state_.store(FULL, std::memory_order_relaxed);
+        segment->enq_.store(1, std::memory_order_relaxed);
+        if (tail->next_.compare_exchange_strong(next, segment)) {
+          tail_.compare_exchange_strong(tail, segment);
+          break;
+        }
+        delete segment;
+      }
+      tail_.compare_exchange_strong(tail, next);
+    }
+    hazard.store(NULL, std::memory_order_release);
+  }
+
+  // If the queue is non-empty, (atomically) sets '*result' equal to the front
+  // element, pops the front element from the queue, and returns true,
+  // otherwise returns false.
+  bool Pop(T* result) {
+    std::atomic<Segment*>& hazard = hazards_[HazardSlot()];
+    bool popped = false;
+    while (true) {
+      Segment* head = Protect(head_, &hazard);
+      // Check for emptiness before claiming a cell, so that polling an empty
+      // queue does not use up cells.
+      if (head->deq_.load() >= head->enq_.load() &&
+          head->next_.load() == NULL)
+        break;
+
+      uint64_t idx = head->deq_.fetch_add(1);
+      if (idx < SEGMENT_SIZE) {
+        Cell& cell = head->cells_[idx];
+        // The producer that claimed this cell may not have filled it yet.
+        // Give it a moment before taking the cell away from it.
+        for (int i = 0; i < SPIN_ROUNDS; i++) {
+          if (cell.state_.load(std::memory_order_acquire) == FULL)
+            break;
+        }
+        if (cell.state_.exchange(TAKEN, std::memory_order_acq_rel) == FULL) {
+          *result = cell.item_;
+          popped = true;
+          break;
+        }
+        continue;
+      }
+
+      // 'head' is drained. Move on to the next segment, first making sure
+      // 'tail_' has moved past 'head' so that retiring it is safe.
+      Segment* next = head->next_.load(std::memory_order_acquire);
+      if (next == NULL)
+        break;
+      Segment* expected = head;
+      tail_.compare_exchange_strong(expected, next);
+      if (head_.compare_exchange_strong(head, next)) {
+        hazard.store(NULL, std::memory_order_release);
+        Retire(head);
+      }
+    }
+    hazard.store(NULL, std::memory_order_release);
+    return popped;
+  }
+
+  // Same as Push(); the queue is never full and pushing never blocks.
+  bool PushNonBlocking(const T& item) {
+    Push(item);
+    return true;
+  }
+
+  // Same as Pop(); popping never blocks.
+  bool PopNonBlocking(T* result) {
+    return Pop(result);
+  }
+
+  // Pushes 'count' elements from 'items', in order. All the cells the batch
+  // gets in the current segment are claimed with one fetch-and-add, and a
+  // segment appended for the rest is filled before it is linked in.
+  void PushBatch(const T* items, int count) {
+    std::atomic<Segment*>& hazard = hazards_[HazardSlot()];
+    int pushed = 0;
+    while (pushed < count) {
+      Segment* tail = Protect(tail_, &hazard);
+      uint64_t idx = tail->enq_.load();
+      if (idx < SEGMENT_SIZE) {
+        uint64_t n = std::min<uint64_t>(count - pushed, SEGMENT_SIZE - idx);
+        // Others may have claimed cells in the meantime, so only cells below
+        // SEGMENT_SIZE are ours.
+        idx = tail->enq_.fetch_add(n);
+        uint64_t end = Clamp(idx + n);
+        for (; idx < end; idx++) {
+          Cell& cell = tail->cells_[idx];
+          cell.item_ = items[pushed];
+          int expected = EMPTY;
+          // If a consumer gave up on the cell, the item goes into the next.
+          if (cell.state_.compare_exchange_strong(expected, FULL,
+                                                  std::memory_order_acq_rel))
+            pushed++;
+        }
+        continue;
+      }
+
+      Segment* next = tail->next_.load(std::memory_order_acquire);
+      if (next == NULL) {
+        Segment* segment = new Segment(tail->base_ + SEGMENT_SIZE);
+        uint64_t n = Clamp(count - pushed);
+        for (uint64_t i = 0; i < n; i++) {
+          segment->cells_[i].item_ = items[pushed + i];
+          segment->cells_[i].state_.store(FULL, std::memory_order_relaxed);
+        }
+        segment->enq_.store(n, std::memory_order_relaxed);
+        if (tail->next_.compare_exchange_strong(next, segment)) {
+          tail_.compare_exchange_strong(tail, segment);
+          pushed += n;
+          continue;
+        }
+        delete segment;
+      }
+      tail_.compare_exchange_strong(tail, next);
+    }
+    hazard.store(NULL, std::memory_order_release);
+  }
+
+  // Pops up to 'max' elements into 'results', front first, and returns how
+  // many were popped. The cells taken from each segment are claimed with one
+  // CAS, and only cells that producers have already claimed.
+  int PopBatch(T* results, int max) {
+    std::atomic<Segment*>& hazard = hazards_[HazardSlot()];
+    int popped = 0;
+    while (popped < max) {
+      Segment* head = Protect(head_, &hazard);
+      uint64_t deq = head->deq_.load();
+      if (deq < SEGMENT_SIZE) {
+        uint64_t enq = Clamp(head->enq_.load());
+        if (deq >= enq)
+          break;
+        uint64_t n = std::min<uint64_t>(max - popped, enq - deq);
+        if (!head->deq_.compare_exchange_weak(deq, deq + n))
+          continue;
+        for (uint64_t idx = deq; idx < deq + n; idx++) {
+          Cell& cell = head->cells_[idx];
+          for (int i = 0; i < SPIN_ROUNDS; i++) {
+            if (cell.state_.load(std::memory_order_acquire) == FULL)
+              break;
+          }
+          if (cell.state_.exchange(TAKEN, std::memory_order_acq_rel) == FULL)
+            results[popped++] = cell.item_;
+        }
+        continue;
+      }
+
+      // 'head' is drained; same as in Pop().
+      Segment* next = head->next_.load(std::memory_order_acquire);
+      if (next == NULL)
+        break;
+      Segment* expected = head;
+      tail_.compare_exchange_strong(expected, next);
+      if (head_.compare_exchange_strong(head, next)) {
+        hazard.store(NULL, std::memory_order_release);
+        Retire(head);
+      }
+    }
+    hazard.store(NULL, std::memory_order_release);
+    return popped;
+  }
+
+ private:
+  // Number of cells in each segment.
+  static const uint64_t SEGMENT_SIZE = 1024;
+
+  // Number of times a consumer checks an unfilled cell before giving up on it.
+  static const int SPIN_ROUNDS = 64;
+
+  // Number of retired segments to collect before trying to free them.
+  static const size_t RETIRE_BATCH = 8;
+
+  // Cell states. A cell goes EMPTY -> FULL -> TAKEN, or EMPTY -> TAKEN if its
+  // consumer gave up on it, in which case its producer retries elsewhere.
+  enum { EMPTY = 0, FULL = 1, TAKEN = 2 };
+
+  struct Cell {
+    Cell() : state_(EMPTY) {}
+    std::atomic<int> state_;
+    T item_;
+  };
+
+  // One segment of the queue. 'base_' is the queue-wide position of cells_[0].
+  struct Segment {
+    explicit Segment(uint64_t base)
+        : base_(base), enq_(0), deq_(0), next_(NULL) {}
+    const uint64_t base_;
+    std::atomic<uint64_t> enq_;
+    char pad0_[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> deq_;
+    char pad1_[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<Segment*> next_;
+    Cell cells_[SEGMENT_SIZE];
+  };
+
+  static uint64_t Clamp(uint64_t idx) {
+    return idx < SEGMENT_SIZE ? idx : SEGMENT_SIZE;
+  }
+
+  // Loads 'src' and publishes it in 'hazard', so that it is not freed until
+  // 'hazard' is cleared.
+  static Segment* Protect(const std::atomic<Segment*>& src,
+                          std::atomic<Segment*>* hazard) {
+    Segment* segment = src.load();
+    while (true) {
+      hazard->store(segment);
+      Segment* again = src.load();
+      if (again == segment)
+        return segment;
+      segment = again;
+    }
+  }
+
+  // Frees 'segment', which is no longer reachable from 'head_' or 'tail_',
+  // once no thread holds a hazard pointer to it.
+  void Retire(Segment* segment) {
+    mutex_.Lock();
+    retired_.push_back(segment);
+    if (retired_.size() >= RETIRE_BATCH) {
+      vector<Segment*> protected_segments;
+      for (int i = 0; i < HAZARD_SLOTS; i++) {
+        Segment* hazard = hazards_[i].load();
+        if (hazard != NULL)
+          protected_segments.push_back(hazard);
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < retired_.size(); i++) {
+        bool in_use = false;
+        for (size_t j = 0; j < protected_segments.size() && !in_use; j++)
+          in_use = protected_segments[j] == retired_[i];
+        if (in_use)
+          retired_[kept++] = retired_[i];
+        else
+          delete retired_[i];
+      }
+      retired_.resize(kept);
+    }
+    mutex_.Unlock();
+  }
+
+  // Oldest and newest segments. Consumers only touch 'head_', producers only
+  // 'tail_'.
+  std::atomic<Segment*> head_;
+  char pad0_[64 - sizeof(std::atomic<Segment*>)];
+  std::atomic<Segment*> tail_;
+  char pad1_[64 - sizeof(std::atomic<Segment*>)];
+
+  // Segment each thread is using, indexed by HazardSlot().
+  std::atomic<Segment*> hazards_[HAZARD_SLOTS];
+
+  // Segments unlinked from the queue but possibly still in use. Only touched
+  // once per SEGMENT_SIZE elements, so a mutex is fine.
+  Mutex mutex_;
+  vector<Segment*> retired_;
+};
+
+#endif  // _DB_UTILS_LOCKFREE_QUEUE_H_
@@ -0,0 +1,214 @@
+// Checks that every queue delivers each pushed element exactly once, and
+// compares the throughput of AtomicQueue, BoundedQueue and SegmentedQueue
+// with varying numbers of producer and consumer threads.
+
+#include "utils/lockfree_queue.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "utils/atomic.h"
+#include "utils/testing.h"
+
+// Elements pushed by each producer in each run.
+#define ITEMS_PER_PRODUCER 200000
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+template<typename Q>
+struct Run {
+  Q* queue;
+  int producers;
+  std::atomic<int> producers_done;
+  std::atomic<long> popped;
+  std::atomic<long> sum;
+  int next_id;
+};
+
+template<typename Q>
+struct Worker {
+  Run<Q>* run;
+  int id;
+};
+
+template<typename Q>
+void* Produce(void* arg) {
+  Worker<Q>* w = reinterpret_cast<Worker<Q>*>(arg);
+  // Element i of producer p is p * ITEMS_PER_PRODUCER + i + 1, so the sum of
+  // everything popped is known in advance.
+  long first = static_cast<long>(w->id) * ITEMS_PER_PRODUCER + 1;
+  for (long i = 0; i < ITEMS_PER_PRODUCER; i++)
+    w->run->queue->Push(first + i);
+  w->run->producers_done++;
+  return NULL;
+}
+
+template<typename Q>
+void* Consume(void* arg) {
+  Worker<Q>* w = reinterpret_cast<Worker<Q>*>(arg);
+  Run<Q>* run = w->run;
+  long popped = 0;
+  long sum = 0;
+  long item;
+  while (true) {
+    if (run->queue->Pop(&item)) {
+      popped++;
+      sum += item;
+    } else if (run->producers_done.load() == run->producers) {
+      // Producers are done; anything pushed is visible by now.
+      if (!run->queue->Pop(&item))
+        break;
+      popped++;
+      sum += item;
+    }
+  }
+  run->popped += popped;
+  run->sum += sum;
+  return NULL;
+}
+
+// Runs 'producers' and 'consumers' threads against 'queue', checks that every
+// element came out exactly once and prints the throughput.
+template<typename Q>
+void Measure(const string& name, Q* queue, int producers, int consumers) {
+  Run<Q> run;
+  run.queue = queue;
+  run.producers = producers;
+  run.producers_done = 0;
+  run.popped = 0;
+  run.sum = 0;
+
+  vector<pthread_t> threads(producers + consumers);
+  vector<Worker<Q> > workers(producers + consumers);
+  double start = Now();
+  for (int i = 0; i < producers + consumers; i++) {
+    workers[i].run = &run;
+    workers[i].id = i;
+    pthread_create(&threads[i], NULL,
+                   i < producers ? Produce<Q> : Consume<Q>, &workers[i]);
+  }
+  for (int i = 0; i < producers + consumers; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = Now() - start;
+
+  long n = static_cast<long>(producers) * ITEMS_PER_PRODUCER;
+  EXPECT_EQ(n, run.popped.load());
+  EXPECT_EQ(n * (n + 1) / 2, run.sum.load());
+  EXPECT_EQ(0, queue->Size());
+
+  printf("%-16s %2dP/%2dC  %6.2f Mops/s\n", name.c_str(), producers, consumers,
+         n / elapsed / 1e6);
+  fflush(stdout);
+}
+
+// Single-threaded Push/Pop pair latency.
+template<typename Q>
+void MeasureLatency(const string& name, Q* queue) {
+  long item;
+  int n = 1000000;
+  double start = Now();
+  for (long i = 0; i < n; i++) {
+    queue->Push(i);
+    queue->Pop(&item);
+  }
+  printf("%-16s Push/Pop: %.1f ns\n", name.c_str(),
+         (Now() - start) / n * 1e9);
+}
+
+TEST(SegmentedQueueFifoTest) {
+  // Spans several segments.
+  SegmentedQueue<long> queue;
+  long item;
+  EXPECT_FALSE(queue.Pop(&item));
+  for (long i = 0; i < 5000; i++)
+    queue.Push(i);
+  EXPECT_EQ(5000, queue.Size());
+  for (long i = 0; i < 5000; i++) {
+    EXPECT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(i, item);
+  }
+  EXPECT_FALSE(queue.Pop(&item));
+  EXPECT_EQ(0, queue.Size());
+
+  END;
+}
+
+TEST(SegmentedQueueBatchTest) {
+  // Batches that straddle segment boundaries, mixed with single elements.
+  SegmentedQueue<long> queue;
+  long items[700];
+  long next = 0;
+  for (int b = 0; b < 8; b++) {
+    for (int i = 0; i < 700; i++)
+      items[i] = next++;
+    queue.PushBatch(items, 700);
+    queue.Push(next++);
+  }
+  EXPECT_EQ(next, queue.Size());
+
+  long expected = 0;
+  long item;
+  while (expected < next) {
+    int popped = queue.PopBatch(items, 500);
+    EXPECT_TRUE(popped > 0);
+    for (int i = 0; i < popped; i++)
+      EXPECT_EQ(expected++, items[i]);
+    if (queue.Pop(&item))
+      EXPECT_EQ(expected++, item);
+  }
+  EXPECT_EQ(0, queue.PopBatch(items, 500));
+  EXPECT_EQ(0, queue.Size());
+
+  END;
+}
+
+TEST(BoundedQueueFullTest) {
+  BoundedQueue<long> queue(1000);  // Rounded up to 1024.
+  long item;
+  for (long i = 0; i < 1024; i++)
+    EXPECT_TRUE(queue.PushNonBlocking(i));
+  EXPECT_FALSE(queue.PushNonBlocking(1024));
+  EXPECT_EQ(1024, queue.Size());
+  EXPECT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(0, item);
+  EXPECT_TRUE(queue.PushNonBlocking(1024));
+
+  END;
+}
+
+TEST(QueueThroughputTest) {
+  int configs[][2] = {{1, 1}, {4, 1}, {1, 4}, {4, 4}, {8, 8}};
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    int p = configs[c][0];
+    int q = configs[c][1];
+    AtomicQueue<long> atomic_queue;
+    Measure("AtomicQueue", &atomic_queue, p, q);
+    BoundedQueue<long> bounded_queue(4096);
+    Measure("BoundedQueue", &bounded_queue, p, q);
+    SegmentedQueue<long> segmented_queue;
+    Measure("SegmentedQueue", &segmented_queue, p, q);
+  }
+
+  AtomicQueue<long> atomic_queue;
+  MeasureLatency("AtomicQueue", &atomic_queue);
+  BoundedQueue<long> bounded_queue;
+  MeasureLatency("BoundedQueue", &bounded_queue);
+  SegmentedQueue<long> segmented_queue;
+  MeasureLatency("SegmentedQueue", &segmented_queue);
+
+  END;
+}
+
+int main(int argc, char** argv) {
+  SegmentedQueueFifoTest();
+  SegmentedQueueBatchTest();
+  BoundedQueueFullTest();
+  QueueThroughputTest();
+}
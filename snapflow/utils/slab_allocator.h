@@ -0,0 +1,164 @@
+/// @file
+///
+/// Per-thread slab allocator for small, fixed-size objects.
+///
+/// Each thread carves objects out of its own slabs and keeps freed objects on
+/// a private free list, so the common New/Delete path takes no lock and never
+/// calls malloc. Objects are padded to a whole number of cache lines and slabs
+/// are cache-line aligned, so neighbouring objects never share a line. When a
+/// thread's free list grows too long (e.g. the thread doing garbage
+/// collection) a batch of objects is handed to a shared depot, from which
+/// threads that run dry refill before allocating a new slab.
+///
+/// Slab memory is never returned to the system; it is recycled for the
+/// lifetime of the process.
+
+#ifndef _DB_UTILS_SLAB_ALLOCATOR_H_
+#define _DB_UTILS_SLAB_ALLOCATOR_H_
+
+#include <stdlib.h>
+#include <new>
+
+#include "utils/mutex.h"
+
+#define CACHE_LINE_SIZE 64
+
+template<typename T>
+class SlabAllocator {
+ public:
+  // Allocates and value-initializes a T.
+  static T* New() {
+    return new (Cache().Allocate()) T();
+  }
+
+  // Destroys and frees a T previously returned by New(). Any thread may free
+  // any object.
+  static void Delete(T* object) {
+    object->~T();
+    Cache().Release(reinterpret_cast<Slot*>(object));
+  }
+
+  // Size in bytes of each object slot (sizeof(T) rounded up to a whole number
+  // of cache lines).
+  static size_t SlotSize() { return sizeof(Slot); }
+
+ private:
+  // Storage for one object. While the slot is free it links the slot into a
+  // free list and, for the first slot of a batch held by the depot, links the
+  // batch into the depot's list of batches.
+  union Slot {
+    struct {
+      Slot* next;
+      Slot* next_batch;
+      size_t batch_size;
+    } link;
+    alignas(CACHE_LINE_SIZE) char data[sizeof(T)];
+  };
+
+  // Number of objects in a slab, which is also the size of the batches moved
+  // between thread caches and the depot, and the most free objects a thread
+  // keeps before returning a batch.
+  static const size_t kSlabObjects = 256;
+  static const size_t kMaxCached = 4 * kSlabObjects;
+
+  // Shared pool of free batches, filled by threads with too many objects.
+  struct Depot {
+    Depot() : batches_(NULL) {}
+    Mutex mutex_;
+    Slot* batches_;
+  };
+
+  static Depot& GetDepot() {
+    static Depot depot;
+    return depot;
+  }
+
+  static Slot* AllocateSlots(size_t n) {
+    Slot* slots;
+    if (posix_memalign(reinterpret_cast<void**>(&slots), CACHE_LINE_SIZE,
+                       n * sizeof(Slot)) != 0) {
+      throw std::bad_alloc();
+    }
+    return slots;
+  }
+
+  class ThreadCache {
+   public:
+    ThreadCache() : free_(NULL), count_(0) {}
+
+    // Hand everything back to the depot when the owning thread exits.
+    ~ThreadCache() {
+      if (count_ > 0)
+        Flush(count_);
+    }
+
+    void* Allocate() {
+      if (free_ == NULL)
+        Refill();
+      Slot* slot = free_;
+      free_ = slot->link.next;
+      --count_;
+      return slot;
+    }
+
+    void Release(Slot* slot) {
+      slot->link.next = free_;
+      free_ = slot;
+      if (++count_ > kMaxCached)
+        Flush(kSlabObjects);
+    }
+
+   private:
+    // Takes a batch from the depot if it has one, else carves a new slab.
+    void Refill() {
+      Depot& depot = GetDepot();
+      depot.mutex_.Lock();
+      Slot* batch = depot.batches_;
+      if (batch != NULL)
+        depot.batches_ = batch->link.next_batch;
+      depot.mutex_.Unlock();
+
+      if (batch != NULL) {
+        free_ = batch;
+        count_ = batch->link.batch_size;
+        return;
+      }
+
+      Slot* slab = AllocateSlots(kSlabObjects);
+      for (size_t i = 0; i < kSlabObjects - 1; i++)
+        slab[i].link.next = &slab[i + 1];
+      slab[kSlabObjects - 1].link.next = NULL;
+      free_ = slab;
+      count_ = kSlabObjects;
+    }
+
+    // Moves 'n' objects from the front of the local free list to the depot
+    // as one batch.
+    void Flush(size_t n) {
+      Slot* first = free_;
+      Slot* last = free_;
+      for (size_t i = 1; i < n; i++)
+        last = last->link.next;
+      free_ = last->link.next;
+      count_ -= n;
+      last->link.next = NULL;
+      first->link.batch_size = n;
+
+      Depot& depot = GetDepot();
+      depot.mutex_.Lock();
+      first->link.next_batch = depot.batches_;
+      depot.batches_ = first;
+      depot.mutex_.Unlock();
+    }
+
+    Slot* free_;
+    size_t count_;
+  };
+
+  static ThreadCache& Cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+};
+
+#endif  // _DB_UTILS_SLAB_ALLOCATOR_H_
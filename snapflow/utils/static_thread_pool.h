@@ -13,6 +13,7 @@
 #include <vector>
 #include <utility>
 #include "utils/atomic.h"
+#include "utils/cpu_topology.h"
 #include "utils/thread_pool.h"
 
 using std::queue;
@@ -23,8 +24,10 @@ using std::pair;
 //
 class StaticThreadPool : public ThreadPool {
  public:
-  StaticThreadPool(int nthreads)
-      : thread_count_(nthreads), stopped_(false) {
+  // Thread i is pinned to cpus[i] if 'cpus' has such an entry and it is not
+  // -1 (see CpuTopology::Place()).
+  StaticThreadPool(int nthreads, const vector<int>& cpus = vector<int>())
+      : thread_count_(nthreads), cpus_(cpus), stopped_(false) {
     Start();
   }
 
@@ -49,25 +52,16 @@ class StaticThreadPool : public ThreadPool {
     threads_.resize(thread_count_);
     queues_.resize(thread_count_);
     
-    // Pin all threads in the thread pool to CPU Core 0 ~ 6
-    cpu_set_t cpuset;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    CPU_ZERO(&cpuset);
-    CPU_SET(0, &cpuset);
-    CPU_SET(1, &cpuset);       
-    CPU_SET(2, &cpuset);
-    CPU_SET(3, &cpuset);
-    CPU_SET(4, &cpuset);
-    CPU_SET(5, &cpuset);
-    CPU_SET(6, &cpuset);            
-    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
-
     for (int i = 0; i < thread_count_; i++) {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      if (i < static_cast<int>(cpus_.size()))
+        SetAffinity(&attr, vector<int>(1, cpus_[i]));
       pthread_create(&threads_[i],
                      &attr,
                      RunThread,
                      reinterpret_cast<void*>(new pair<int, StaticThreadPool*>(i, this)));
+      pthread_attr_destroy(&attr);
     }
   }
 
@@ -80,8 +74,7 @@ class StaticThreadPool : public ThreadPool {
     int sleep_duration = 1;  // in microseconds
     while (true) {
       if (tp->queues_[queue_id].PopNonBlocking(&task)) {
-        task->Run();
-        delete task;
+        RunPoolTask(task);
         // Reset backoff.
         sleep_duration = 1;
       } else {
@@ -94,8 +87,7 @@ class StaticThreadPool : public ThreadPool {
       if (tp->stopped_) {
         // Go through ALL queues looking for a remaining task.
         while (tp->queues_[queue_id].Pop(&task)) {
-            task->Run();
-            delete task;
+            RunPoolTask(task);
         }
 
         break;
@@ -105,6 +97,7 @@ class StaticThreadPool : public ThreadPool {
   }
 
   int thread_count_;
+  vector<int> cpus_;
   vector<pthread_t> threads_;
 
   // Task queues.
@@ -32,8 +32,22 @@ class Task {
 
   // Run the task.
   virtual void Run() = 0;
+
+  // Whether the thread pool running the task deletes it afterwards (the
+  // default). Tasks embedded in another object return false, and may be
+  // freed along with that object by their own Run().
+  virtual bool PoolOwned() const { return true; }
 };
 
+// Runs a task taken off a thread pool's queue, then deletes it if the pool
+// owns it. The task must not be touched after Run() otherwise.
+inline void RunPoolTask(Task* task) {
+  bool owned = task->PoolOwned();
+  task->Run();
+  if (owned)
+    delete task;
+}
+
 /// @class RTask<R>
 ///
 /// All tasks have the (possibly void) return types of their associated
@@ -165,6 +179,33 @@ class Method : public RTask<R> {
   E e_;
 };
 
+/// @class EmbeddedMethod<T, A>
+///
+/// A call to a one-argument void method, meant to live inside an object that
+/// is handed to a thread pool over and over (e.g. a txn being scheduled), so
+/// that dispatching it allocates nothing. Set() re-arms it before each
+/// RunTask(); the pool never deletes it.
+template<class T, typename A>
+class EmbeddedMethod : public Task {
+ public:
+  EmbeddedMethod() : t_(NULL), f_(NULL) {}
+
+  void Set(T* t, void (T::*f)(A), A a) {
+    t_ = t;
+    f_ = f;
+    a_ = a;
+  }
+
+  virtual void Run() { (t_->*f_)(a_); }
+
+  virtual bool PoolOwned() const { return false; }
+
+ private:
+  T* t_;
+  void (T::*f_)(A);
+  A a_;
+};
+
 ////////////////////////   Implementation details   ////////////////////////
 // TODO(alex): This should be moved to task.cc, but that seems to be causing
 //             compilation issues.
@@ -0,0 +1,289 @@
+/// @file
+///
+/// Work-stealing thread pool.
+///
+/// Every worker owns a Chase-Lev deque. Tasks submitted by a worker go to the
+/// bottom of its own deque and are popped back LIFO, so spawning is lock-free
+/// and cache-warm. Tasks submitted from outside the pool are handed round-robin
+/// to per-worker inboxes. A worker that runs out of work steals FIFO from the
+/// top of a random victim's deque (or its inbox), spins briefly, and then
+/// parks on a futex until a submitter wakes it.
+///
+/// The Chase-Lev deque follows Le, Pop, Cohen and Zappa Nardelli, "Correct and
+/// Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+
+#ifndef _DB_UTILS_WORK_STEALING_THREAD_POOL_H_
+#define _DB_UTILS_WORK_STEALING_THREAD_POOL_H_
+
+#include <pthread.h>
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "utils/cpu_topology.h"
+#include "utils/futex.h"
+#include "utils/lockfree_queue.h"
+#include "utils/thread_pool.h"
+
+using std::pair;
+using std::vector;
+
+/// @class TaskDeque
+///
+/// Fixed-capacity Chase-Lev deque of tasks. Only the owning worker may call
+/// Push() and Take(); any thread may call Steal().
+class TaskDeque {
+ public:
+  // Capacity of a deque. Must be a power of two.
+  static const int64_t kCapacity = 1024;
+
+  TaskDeque() : top_(0), bottom_(0) {
+    for (int64_t i = 0; i < kCapacity; i++)
+      tasks_[i].store(NULL, std::memory_order_relaxed);
+  }
+
+  // Adds 'task' at the bottom. Returns false if the deque is full.
+  bool Push(Task* task) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    if (b - t >= kCapacity)
+      return false;
+    tasks_[b & (kCapacity - 1)].store(task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Removes the most recently pushed task. Returns NULL if the deque is empty.
+  Task* Take() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+
+    Task* task = NULL;
+    if (t <= b) {
+      task = tasks_[b & (kCapacity - 1)].load(std::memory_order_relaxed);
+      if (t == b) {
+        // Last task: race the thieves for it.
+        if (!top_.compare_exchange_strong(t, t + 1,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+          task = NULL;
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // Removes the oldest task. Returns NULL if the deque is empty or another
+  // thread took the task first.
+  Task* Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+
+    if (t < b) {
+      Task* task = tasks_[t & (kCapacity - 1)].load(std::memory_order_relaxed);
+      if (top_.compare_exchange_strong(t, t + 1,
+                                       std::memory_order_seq_cst,
+                                       std::memory_order_relaxed))
+        return task;
+    }
+    return NULL;
+  }
+
+ private:
+  // Thieves move 'top_', the owner moves 'bottom_'; keep them on separate
+  // cache lines. (Padding rather than alignas, since C++11 operator new
+  // does not honour extended alignment.)
+  std::atomic<int64_t> top_;
+  char pad_[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> bottom_;
+  std::atomic<Task*> tasks_[kCapacity];
+};
+
+/// @class WorkStealingThreadPool
+///
+/// Drop-in replacement for StaticThreadPool.
+class WorkStealingThreadPool : public ThreadPool {
+ public:
+  // Worker i is pinned to cpus[i] if 'cpus' has such an entry and it is not
+  // -1 (see CpuTopology::Place()).
+  explicit WorkStealingThreadPool(int nthreads,
+                                  const vector<int>& cpus = vector<int>())
+      : thread_count_(nthreads), cpus_(cpus), stopped_(false), next_inbox_(0),
+        sleepers_(0), wake_seq_(0) {
+    // Spinning only pays off if another core can produce work meanwhile.
+    spin_rounds_ = std::thread::hardware_concurrency() > 1 ? kSpinRounds : 1;
+    Start();
+  }
+
+  ~WorkStealingThreadPool() {
+    Stop();
+    for (int i = 0; i < thread_count_; i++)
+      delete workers_[i];
+  }
+
+  // Runs every task that is still queued, then joins the workers. No tasks
+  // may be submitted afterwards. Safe to call more than once.
+  void Stop() {
+    if (stopped_.exchange(true))
+      return;
+    WakeAll();
+    for (int i = 0; i < thread_count_; i++)
+      pthread_join(threads_[i], NULL);
+  }
+
+  bool Active() { return !stopped_; }
+
+  virtual void RunTask(Task* task) {
+    assert(!stopped_);
+    Worker* self = CurrentWorker();
+    if (self == NULL || !self->deque_.Push(task)) {
+      // Submitted from outside the pool (or our deque is full).
+      int inbox = next_inbox_.fetch_add(1, std::memory_order_relaxed) %
+                  thread_count_;
+      workers_[inbox]->inbox_.Push(task);
+    }
+    // Pairs with the sleepers_ increment in RunThread: either the parking
+    // worker sees our task, or we see it parking and wake it.
+    if (sleepers_.load(std::memory_order_seq_cst) > 0)
+      WakeOne();
+  }
+
+  virtual int ThreadCount() { return thread_count_; }
+
+ private:
+  // Number of times an idle worker looks for work before it parks, on
+  // machines with more than one core.
+  static const int kSpinRounds = 64;
+
+  // Longest time (in seconds) a parked worker sleeps before looking again, as
+  // a guard against missed wakeups.
+  static constexpr double kParkTime = 0.001;
+
+  struct Worker {
+    explicit Worker(WorkStealingThreadPool* pool) : pool_(pool) {}
+    TaskDeque deque_;
+    SegmentedQueue<Task*> inbox_;
+    // Pool the worker belongs to, so a thread can tell in O(1) whether it
+    // is one of ours.
+    WorkStealingThreadPool* pool_;
+  };
+
+  void Start() {
+    threads_.resize(thread_count_);
+    for (int i = 0; i < thread_count_; i++)
+      workers_.push_back(new Worker(this));
+
+    for (int i = 0; i < thread_count_; i++) {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      if (i < static_cast<int>(cpus_.size()))
+        SetAffinity(&attr, vector<int>(1, cpus_[i]));
+      pthread_create(&threads_[i],
+                     &attr,
+                     RunThread,
+                     reinterpret_cast<void*>(new pair<int, WorkStealingThreadPool*>(i, this)));
+      pthread_attr_destroy(&attr);
+    }
+  }
+
+  // The worker the calling thread is, if it belongs to this pool.
+  static Worker*& CurrentWorkerSlot() {
+    static thread_local Worker* worker = NULL;
+    return worker;
+  }
+
+  Worker* CurrentWorker() {
+    Worker* worker = CurrentWorkerSlot();
+    return worker != NULL && worker->pool_ == this ? worker : NULL;
+  }
+
+  // Looks for a task: own deque first, then own inbox, then the other
+  // workers starting from a random victim.
+  Task* FindTask(int id, unsigned int* seed) {
+    Worker* self = workers_[id];
+    Task* task = self->deque_.Take();
+    if (task != NULL || self->inbox_.Pop(&task))
+      return task;
+
+    int victim = rand_r(seed) % thread_count_;
+    for (int i = 0; i < thread_count_; i++, victim = (victim + 1) % thread_count_) {
+      if (victim == id)
+        continue;
+      task = workers_[victim]->deque_.Steal();
+      if (task != NULL || workers_[victim]->inbox_.PopNonBlocking(&task))
+        return task;
+    }
+    return NULL;
+  }
+
+  void WakeOne() {
+    wake_seq_.fetch_add(1, std::memory_order_seq_cst);
+    FutexWake(&wake_seq_, 1);
+  }
+
+  void WakeAll() {
+    wake_seq_.fetch_add(1, std::memory_order_seq_cst);
+    FutexWake(&wake_seq_, thread_count_);
+  }
+
+  // Function executed by each pthread.
+  static void* RunThread(void* arg) {
+    int id = reinterpret_cast<pair<int, WorkStealingThreadPool*>*>(arg)->first;
+    WorkStealingThreadPool* tp = reinterpret_cast<pair<int, WorkStealingThreadPool*>*>(arg)->second;
+    delete reinterpret_cast<pair<int, WorkStealingThreadPool*>*>(arg);
+    CurrentWorkerSlot() = tp->workers_[id];
+    unsigned int seed = id;
+
+    while (true) {
+      Task* task = NULL;
+      for (int i = 0; i < tp->spin_rounds_ && task == NULL; i++)
+        task = tp->FindTask(id, &seed);
+
+      if (task == NULL) {
+        // Nothing queued anywhere. Announce that we are about to park, then
+        // look once more so that a concurrent RunTask cannot be missed.
+        int seq = tp->wake_seq_.load(std::memory_order_seq_cst);
+        tp->sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        task = tp->FindTask(id, &seed);
+        if (task == NULL) {
+          if (tp->stopped_) {
+            tp->sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+            break;
+          }
+          FutexWait(&tp->wake_seq_, seq, kParkTime);
+        }
+        tp->sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+      }
+
+      if (task != NULL)
+        RunPoolTask(task);
+    }
+    return NULL;
+  }
+
+  int thread_count_;
+  vector<int> cpus_;
+  int spin_rounds_;
+  vector<pthread_t> threads_;
+  vector<Worker*> workers_;
+
+  std::atomic<bool> stopped_;
+
+  // Round-robin cursor for tasks submitted from outside the pool.
+  std::atomic<unsigned int> next_inbox_;
+
+  // Number of workers that are parked or about to park, and the futex word
+  // they park on (bumped by every wakeup).
+  std::atomic<int> sleepers_;
+  std::atomic<int> wake_seq_;
+};
+
+#endif  // _DB_UTILS_WORK_STEALING_THREAD_POOL_H_